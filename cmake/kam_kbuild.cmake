@@ -14,10 +14,12 @@ endfunction()
 #   OUT_DIR = the output directory for stap results
 #   GEN_SRC = SystemTap .stp script
 #   SRC = Other sources that need to be built for this module
+#   DEPS = file dependencies (if one of those is modified the module
+#          gets rebuilt)
 #
 #   Unnamed parameters:
-#   ARGN = file dependencies (if one of those is modified the module
-#          gets rebuilt)
+#   ARGV5 = Module.symvers of the modules whose exported symbols this one
+#           uses (optional, passed as KBUILD_EXTRA_SYMBOLS)
 #
 #  ====================================================================
 function(KAM_KBUILD MOD_NAME INCLUDES OUT_DIR SRC DEPS)
@@ -41,33 +43,38 @@ function(KAM_KBUILD MOD_NAME INCLUDES OUT_DIR SRC DEPS)
     set(K_DBG "-g")
   endif()
 
-  # Generate object file list
+  # Generate object file list. The sources are copied into OUT_DIR, so that
+  # kbuild writes all its outputs there and modules sharing sources do not
+  # step on each other.
   foreach(SRC_FIL ${SRC})
     get_filename_component(ABS_PATH ${SRC_FIL} ABSOLUTE)
-    get_filename_component(SRCF_DIR ${ABS_PATH} DIRECTORY)
     get_filename_component(FNAME ${ABS_PATH} NAME)
     get_filename_component(FNAME_NAME ${ABS_PATH} NAME_WE)
 
-    file(RELATIVE_PATH _add_file ${OUT_DIR} ${SRCF_DIR}/${FNAME})
-    get_filename_component(S_REL ${_add_file} DIRECTORY)
-
-    list(FIND _kam_objs ${S_REL}/${FNAME_NAME}.o _contains_already)
+    list(FIND _kam_objs ${FNAME_NAME}.o _contains_already)
     if(${_contains_already} EQUAL -1)
-      list(APPEND _kam_objs ${S_REL}/${FNAME_NAME}.o)
+      list(APPEND _kam_objs ${FNAME_NAME}.o)
       list(APPEND _kam_objsfp ${OUT_DIR}/${FNAME_NAME}.o)
       list(APPEND _kam_srcf ${SRC_FIL})
+      list(APPEND _kam_copy COMMAND ${CMAKE_COMMAND} -E copy_if_different
+                            ${ABS_PATH} ${OUT_DIR}/${FNAME})
     endif()
   endforeach()
   JOIN("${_kam_objs}" " " KAM_O_FILES)
 
   # Generate kernel module Makefile
+  set(KAM_MOD_NAME ${MOD_NAME})
+  set(KAM_EXTRA_SYMBOLS "")
+  if(${ARGC} GREATER 5)
+    set(KAM_EXTRA_SYMBOLS ${ARGV5})
+  endif()
   configure_file(
     "${PROJECT_SOURCE_DIR}/Makefile.in"
     "${OUT_DIR}/Makefile"
     @ONLY)
 
   # Build kernel module
-  set( MODULE_TARGET_NAME kamprobes )
+  set( MODULE_TARGET_NAME ${MOD_NAME} )
   set( MODULE_BIN_FILE    ${OUT_DIR}/${MOD_NAME}.ko )
   set( MODULE_OUTPUT_FILES    ${_kam_objsfp} )
   set( MODULE_SOURCE_DIR  ${OUT_DIR} )
@@ -79,11 +86,9 @@ function(KAM_KBUILD MOD_NAME INCLUDES OUT_DIR SRC DEPS)
 
   add_custom_command( OUTPUT  ${MODULE_BIN_FILE}
                               ${MODULE_OUTPUT_FILES}
+                      ${_kam_copy}
                       COMMAND ${KBUILD_CMD}
                       COMMAND cp -f ${MODULE_BIN_FILE} ${PROJECT_BINARY_DIR}
-                      COMMAND find ../src -name "*.o" -exec mv {} ${OUT_DIR} \;
-                      COMMAND find ../src -name "*.o.d" -exec mv {} ${OUT_DIR} \;
-                      COMMAND find ../src -name "*.cmd" -exec mv {} ${OUT_DIR} \;
                       DEPENDS ${_kam_srcf} ${DEPS}
                       COMMENT "Running kbuild for ${MODULE_BIN_FILE}"
                       VERBATIM )
@@ -0,0 +1,82 @@
+/**** Notice
+ * acct.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_ACCT_H_
+#define _KAM_ACCT_H_
+
+#include <linux/types.h>
+
+/*
+ * Per-task resource accounting
+ *
+ * Kernel time spent in instrumented subsystems is attributed to the task that
+ * triggered it, per subsystem subtype (the SSSS bits of the probe type, see
+ * kam/probes.h). The accumulators of a thread live in a page that the thread
+ * maps read-only into its address space, so reading them needs no syscall:
+ *
+ *   int fd = open("/dev/" KAM_ACCT_DEVICE, O_RDONLY);
+ *   const struct kam_acct_page *acct =
+ *     mmap(NULL, sizeof(struct kam_acct_page), PROT_READ, MAP_SHARED, fd, 0);
+ *   ...
+ *   start = acct->sub[subtype].cycles;
+ *   do_request();
+ *   spent = acct->sub[subtype].cycles - start;
+ *
+ * Each thread must do its own mmap: the page is bound to the thread calling
+ * mmap(), and is only updated while that thread runs in the kernel. This is
+ * also why reads need no synchronization: the owning thread never reads its
+ * page while it is being updated.
+ *
+ * Only the outermost entry into a subtype is timed (nested or recursive
+ * probes of the same subtype count calls only). Cycles are inclusive of the
+ * time spent blocked. Probes firing while an interrupt, softirq or NMI is
+ * being served are not accounted; task context with bottom halves disabled
+ * (e.g. under spin_lock_bh) is.
+ */
+
+#define KAM_ACCT_DEVICE "kam_acct"
+#define KAM_ACCT_VERSION 1
+#define KAM_ACCT_SUBTYPES 16
+
+struct kam_acct_sub {
+  __u64 calls;
+  __u64 cycles;
+};
+
+struct kam_acct_page {
+  __u32 version;
+  __u32 nr_subtypes;
+  struct kam_acct_sub sub[KAM_ACCT_SUBTYPES];
+};
+
+#ifdef __KERNEL__
+#include "kam/probes.h"
+
+#define KAM_ACCT_SUBTYPE(addr_type) (((u8)(addr_type)) >> ADDR_FIXED_BITS)
+
+/*
+ * Account entry into / return from a subsystem of the given subtype, for the
+ * current task. Cheap no-ops for tasks that have not mapped their page.
+ * Subsystem handlers call these directly; probes that need no other handling
+ * can use the callouts below instead (data = subtype):
+ *
+ *   probe.callout = (kam_callout){.on_entry = kam_acct_callout_enter,
+ *                                 .on_return = kam_acct_callout_exit,
+ *                                 .data = KAM_ACCT_SUBTYPE(probe.addr_type)};
+ */
+void kam_acct_enter(u8 subtype);
+void kam_acct_exit(u8 subtype);
+void kam_acct_callout_enter(struct kam_regs *regs, unsigned long subtype);
+void kam_acct_callout_exit(struct kam_regs *regs, unsigned long subtype);
+
+int kam_acct_init(void);
+void kam_acct_free(void);
+#endif
+
+#endif
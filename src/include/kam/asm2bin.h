@@ -10,18 +10,23 @@
 #ifndef _KAM_ASM2BIN_H_
 #define _KAM_ASM2BIN_H_
 
-inline char neg_c2(uint8_t val){
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include "kam/constants.h"
+
+static inline char neg_c2(uint8_t val){
   return (~val)+1;
 }
 
-inline void emit_rel_address(char **wrapper_end, char *addr)
+static inline void emit_rel_address(char **wrapper_end, char *addr)
 {
   int32_t *w_end = (int32_t *)*wrapper_end;
   *w_end = (int32_t)(addr - 4 - *wrapper_end);
   (*wrapper_end) += 4;
 }
 
-inline void emit_abs_address(char **wrapper_end, char *addr)
+static inline void emit_abs_address(char **wrapper_end, char *addr)
 {
   int32_t *w_end = (int32_t *)*wrapper_end;
   // Make a 32 bit pointer.
@@ -29,33 +34,33 @@ inline void emit_abs_address(char **wrapper_end, char *addr)
   (*wrapper_end) += 4;
 }
 
-inline void emit_insn(char **wrapper_end, char c)
+static inline void emit_insn(char **wrapper_end, char c)
 {
   **wrapper_end = c;
   (*wrapper_end)++;
 }
 
-inline void emit_multiple_insn(char **wrapper_end, const char *c, int num_insn)
+static inline void emit_multiple_insn(char **wrapper_end, const char *c, int num_insn)
 {
   memcpy(*wrapper_end, c, num_insn);
   (*wrapper_end) += num_insn;
 }
 
-inline void emit_jump(char **wrapper_end, char *addr)
+static inline void emit_jump(char **wrapper_end, char *addr)
 {
   **wrapper_end = 0xe9;
   (*wrapper_end)++;
   emit_rel_address(wrapper_end, addr);
 }
 
-inline void emit_callq(char **wrapper_end, char *addr)
+static inline void emit_callq(char **wrapper_end, char *addr)
 {
   **wrapper_end = 0xe8;
   (*wrapper_end)++;
   emit_rel_address(wrapper_end, addr);
 }
 
-inline void emit_return_address_to_r11(char **wrapper_end, char *wrapper_fp)
+static inline void emit_return_address_to_r11(char **wrapper_end, char *wrapper_fp)
 {
   // mov r11, [rip-addr]
   const char machine_code[] = {0x4c, 0x8b, 0x1d};
@@ -63,14 +68,14 @@ inline void emit_return_address_to_r11(char **wrapper_end, char *wrapper_fp)
   emit_rel_address(wrapper_end, wrapper_fp - 8);
 }
 
-inline void emit_mov_rsp_r11(char **wrapper_end)
+static inline void emit_mov_rsp_r11(char **wrapper_end)
 {
   // mov (%rsp), %r11
   const char machine_code[] = {0x4c, 0x8b, 0x1c, 0x24};
   emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
 }
 
-inline void emit_mov_r11_addr(char **wrapper_end, char *addr)
+static inline void emit_mov_r11_addr(char **wrapper_end, char *addr)
 {
   // mov %r11, addr
   const char machine_code[] = {0x4c, 0x89, 0x1d};
@@ -78,13 +83,13 @@ inline void emit_mov_r11_addr(char **wrapper_end, char *addr)
   emit_rel_address(wrapper_end, addr);
 }
 
-inline void emit_push_r11(char **wrapper_end)
+static inline void emit_push_r11(char **wrapper_end)
 {
     emit_insn(wrapper_end, 0x41);
     emit_insn(wrapper_end, 0x53);
 }
 
-inline void emit_mov_addr_rsp(char **wrapper_end, char *addr, const char disp)
+static inline void emit_mov_addr_rsp(char **wrapper_end, char *addr, const char disp)
 {
   // mov $addr disp(%rsp)
   char machine_code[] = {0x48, 0xc7, 0x44, 0x24, 0x00};
@@ -98,7 +103,7 @@ inline void emit_mov_addr_rsp(char **wrapper_end, char *addr, const char disp)
   emit_abs_address(wrapper_end, addr);
 }
 
-inline void emit_mov_r11_rsp(char **wrapper_end, const char disp)
+static inline void emit_mov_r11_rsp(char **wrapper_end, const char disp)
 {
   // mov %r11 disp(%rsp)
   char machine_code[] = {0x4c, 0x89, 0x5c, 0x24, 0x00};
@@ -111,7 +116,7 @@ inline void emit_mov_r11_rsp(char **wrapper_end, const char disp)
   }
 }
 
-inline void emit_mov_int_rsp(char **wrapper_end, uint32_t val, const char disp)
+static inline void emit_mov_int_rsp(char **wrapper_end, uint32_t val, const char disp)
 {
   int mask, j;
   // [AT&T]  movl $val disp(%rsp)
@@ -127,14 +132,30 @@ inline void emit_mov_int_rsp(char **wrapper_end, uint32_t val, const char disp)
   emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
 }
 
-inline void emit_push_addr(char **wrapper_end, char *addr)
+static inline void emit_push_addr(char **wrapper_end, char *addr)
 {
   // push ($addr)
   emit_insn(wrapper_end, 0x68);
   emit_abs_address(wrapper_end, addr);
 }
 
-inline void emit_short_cond_jmp(char **wrapper_end, const char *cond,
+static inline void emit_lock_inc_rip(char **wrapper_end, char *addr)
+{
+  // lock incl addr(%rip)
+  const char machine_code[] = {0xf0, 0xff, 0x05};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_rel_address(wrapper_end, addr);
+}
+
+static inline void emit_lock_dec_rip(char **wrapper_end, char *addr)
+{
+  // lock decl addr(%rip)
+  const char machine_code[] = {0xf0, 0xff, 0x0d};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_rel_address(wrapper_end, addr);
+}
+
+static inline void emit_short_cond_jmp(char **wrapper_end, const char *cond,
                                 size_t cond_size, char jmp_size){
   int i;
   for (i = 0; i < cond_size; i++) {
@@ -146,12 +167,189 @@ inline void emit_short_cond_jmp(char **wrapper_end, const char *cond,
   emit_insn(wrapper_end, jmp_size);
 }
 
-inline int is_call_insn(u8 *addr)
+static inline void emit_int32(char **wrapper_end, uint32_t val)
+{
+  uint32_t *w_end = (uint32_t *)*wrapper_end;
+  *w_end = val;
+  (*wrapper_end) += 4;
+}
+
+/*
+ * gs-relative accesses, used for per-cpu variables. The address of a per-cpu
+ * variable defined in the kernel or in a module is its offset from the %gs
+ * base, which always fits in a signed 32 bit displacement.
+ */
+static inline void emit_inc_gs(char **wrapper_end, char *pcpu_addr)
+{
+  // incl %gs:pcpu_addr
+  const char machine_code[] = {0x65, 0xff, 0x04, 0x25};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, (uint32_t)(unsigned long)pcpu_addr);
+}
+
+static inline void emit_dec_gs(char **wrapper_end, char *pcpu_addr)
+{
+  // decl %gs:pcpu_addr
+  const char machine_code[] = {0x65, 0xff, 0x0c, 0x25};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, (uint32_t)(unsigned long)pcpu_addr);
+}
+
+static inline void emit_mov_int_r11d(char **wrapper_end, uint32_t val)
+{
+  // mov $val, %r11d
+  const char machine_code[] = {0x41, 0xbb};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, val);
+}
+
+static inline void emit_xadd_r11d_gs(char **wrapper_end, char *pcpu_addr)
+{
+  // xadd %r11d, %gs:pcpu_addr
+  const char machine_code[] = {0x65, 0x44, 0x0f, 0xc1, 0x1c, 0x25};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, (uint32_t)(unsigned long)pcpu_addr);
+}
+
+static inline void emit_and_int_r11d(char **wrapper_end, uint32_t val)
+{
+  // and $val, %r11d
+  const char machine_code[] = {0x41, 0x81, 0xe3};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, val);
+}
+
+static inline void emit_shl_r11(char **wrapper_end, uint8_t shift)
+{
+  // shl $shift, %r11
+  const char machine_code[] = {0x49, 0xc1, 0xe3};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_insn(wrapper_end, shift);
+}
+
+static inline void emit_add_gs_r11(char **wrapper_end, char *pcpu_addr)
+{
+  // add %gs:pcpu_addr, %r11
+  const char machine_code[] = {0x65, 0x4c, 0x03, 0x1c, 0x25};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_int32(wrapper_end, (uint32_t)(unsigned long)pcpu_addr);
+}
+
+static inline void emit_mov_int_r11(char **wrapper_end, uint32_t val,
+                                    const char disp)
+{
+  // movl $val, disp(%r11)
+  const char machine_code[] = {0x41, 0xc7, 0x43};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_insn(wrapper_end, disp);
+  emit_int32(wrapper_end, val);
+}
+
+/*
+ * Registers are given by their x86 encoding number (rax = 0, ..., rdi = 7,
+ * r8 = 8, ..., r15 = 15).
+ */
+static inline void emit_mov_reg_r11(char **wrapper_end, uint8_t reg,
+                                    const char disp)
+{
+  // mov %reg, disp(%r11)
+  emit_insn(wrapper_end, 0x49 | ((reg & 0x8) >> 1));
+  emit_insn(wrapper_end, 0x89);
+  emit_insn(wrapper_end, 0x43 | ((reg & 0x7) << 3));
+  emit_insn(wrapper_end, disp);
+}
+
+/*
+ * %r10 = %reg ? *(u64 *)(%reg + disp) : 0
+ * Only NULL is checked for; any other invalid pointer still faults.
+ */
+static inline void emit_mov_deref_r10(char **wrapper_end, uint8_t reg,
+                                      int32_t disp)
+{
+  // xor %r10d, %r10d
+  emit_insn(wrapper_end, 0x45);
+  emit_insn(wrapper_end, 0x31);
+  emit_insn(wrapper_end, 0xd2);
+  // test %reg, %reg
+  emit_insn(wrapper_end, 0x48 | ((reg & 0x8) >> 1) | ((reg & 0x8) >> 3));
+  emit_insn(wrapper_end, 0x85);
+  emit_insn(wrapper_end, 0xc0 | ((reg & 0x7) << 3) | (reg & 0x7));
+  // jz 1f [over the mov]
+  emit_insn(wrapper_end, 0x74);
+  emit_insn(wrapper_end, 7);
+  // mov disp(%reg), %r10
+  // %rsp and %r12 would need a SIB byte; they never hold arguments
+  emit_insn(wrapper_end, 0x4c | ((reg & 0x8) >> 3));
+  emit_insn(wrapper_end, 0x8b);
+  emit_insn(wrapper_end, 0x90 | (reg & 0x7));
+  emit_int32(wrapper_end, (uint32_t)disp);
+}
+
+/*
+ * Save the argument registers (and %rax, keeping 16 byte alignment) so that
+ * they form a struct kam_regs at the top of the stack.
+ */
+static inline void emit_save_args(char **wrapper_end)
+{
+  // push %rdi; push %rsi; push %rdx; push %rcx; push %r8; push %r9; push %rax
+  const char machine_code[] = {0x57, 0x56, 0x52, 0x51, 0x41, 0x50,
+                               0x41, 0x51, 0x50};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+}
+
+static inline void emit_restore_args(char **wrapper_end)
+{
+  // pop %rax; pop %r9; pop %r8; pop %rcx; pop %rdx; pop %rsi; pop %rdi
+  const char machine_code[] = {0x58, 0x41, 0x59, 0x41, 0x58, 0x59,
+                               0x5a, 0x5e, 0x5f};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+}
+
+static inline void emit_mov_rsp_rdi(char **wrapper_end)
+{
+  // mov %rsp, %rdi
+  const char machine_code[] = {0x48, 0x89, 0xe7};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+}
+
+static inline void emit_movabs_rsi(char **wrapper_end, uint64_t val)
+{
+  // movabs $val, %rsi
+  const char machine_code[] = {0x48, 0xbe};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  memcpy(*wrapper_end, &val, sizeof(val));
+  (*wrapper_end) += sizeof(val);
+}
+
+static inline void emit_sub_rsp(char **wrapper_end, uint8_t val)
+{
+  // sub $val, %rsp
+  const char machine_code[] = {0x48, 0x83, 0xec};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_insn(wrapper_end, val);
+}
+
+static inline void emit_add_rsp(char **wrapper_end, uint8_t val)
+{
+  // add $val, %rsp
+  const char machine_code[] = {0x48, 0x83, 0xc4};
+  emit_multiple_insn(wrapper_end, machine_code, sizeof(machine_code));
+  emit_insn(wrapper_end, val);
+}
+
+static inline u8 *call_insn_target(u8 *addr)
+{
+  int32_t offset = (addr[1]) + (addr[2] << 8) +
+                   (addr[3] << 16) + (addr[4] << 24);
+  return addr + CALL_WIDTH + offset;
+}
+
+static inline int is_call_insn(u8 *addr)
 {
   return *addr == 0xe8;
 }
 
-inline int is_noop(u8 *addr)
+static inline int is_noop(u8 *addr)
 {
   return (*addr == 0x90 || *addr == 0x0f || *addr == 0x1f || *addr == 0x66);
 }
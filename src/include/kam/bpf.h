@@ -0,0 +1,71 @@
+/**** Notice
+ * bpf.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_BPF_H_
+#define _KAM_BPF_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * eBPF programs as probe handlers
+ *
+ * A BPF_PROG_TYPE_KPROBE program loaded with bpf(2) can be attached as the
+ * entry and/or return handler of a kamprobe through /dev/kam_bpf, without
+ * building a kernel module for it:
+ *
+ *   struct kam_bpf_attach at = {.sym = "vfs_read", .offset = 0x42,
+ *                               .addr_type = ADDR_OF_CALL,
+ *                               .entry_fd = prog_fd, .return_fd = -1};
+ *   ioctl(fd, KAM_BPF_ATTACH, &at);   // at.id identifies the probe
+ *   ...
+ *   ioctl(fd, KAM_BPF_DETACH, &at.id);
+ *
+ * The probe is a callout probe (see kam/probes.h): the wrapper saves the
+ * argument registers and the programs run with a struct pt_regs context
+ * holding them, so the usual PT_REGS_PARM1..6(ctx) accessors work. On the
+ * return path, PT_REGS_RC(ctx) is the return value. ip is the probed site on
+ * entry and the return address on return; sp is the stack pointer as seen by
+ * the probed function on entry and by the caller after the return. Other
+ * registers read as 0.
+ *
+ * The offset must be that of an instruction of sym, and that instruction a
+ * 5-byte call or nop (such as the __fentry__ call site at offset 0); other
+ * offsets are rejected with EINVAL.
+ *
+ * As for every callout probe, return programs are only supported on call-site
+ * probes (ADDR_OF_CALL). As for kprobe programs, they do not run if they are
+ * hit while another tracing BPF program (kamprobes, kprobe, tracepoint, ...)
+ * is running on the same cpu.
+ *
+ * The device requires CAP_SYS_ADMIN.
+ */
+
+#define KAM_BPF_DEVICE "kam_bpf"
+#define KAM_BPF_SYM_LEN 128
+
+struct kam_bpf_attach {
+  char sym[KAM_BPF_SYM_LEN]; // function containing the probed site
+  __u32 offset;              // of the site within sym
+  __u32 addr_type;           // ADDR_OF_CALL or ADDR_OF_FUNC, plus subtype bits
+  __s32 entry_fd;            // program fds, -1 if not used
+  __s32 return_fd;
+  __u32 id;                  // set by KAM_BPF_ATTACH
+};
+
+#define KAM_BPF_IOC_MAGIC 0xb7
+#define KAM_BPF_ATTACH _IOWR(KAM_BPF_IOC_MAGIC, 1, struct kam_bpf_attach)
+#define KAM_BPF_DETACH _IOW(KAM_BPF_IOC_MAGIC, 2, __u32)
+
+#ifdef __KERNEL__
+int kam_bpf_init(void);
+void kam_bpf_free(void);
+#endif
+
+#endif
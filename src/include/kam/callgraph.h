@@ -0,0 +1,46 @@
+/**** Notice
+ * callgraph.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_CALLGRAPH_H_
+#define _KAM_CALLGRAPH_H_
+
+/*
+ * Call-edge profiling of a whole function
+ *
+ * kam_callgraph_start(func) decodes the body of func (bounds taken from
+ * kallsyms), finds every direct call (e8) in it and registers callout probes on
+ * all of them in one batch. Each probe counts the calls made through its site
+ * and the cycles spent in the callee, in per-cpu tables:
+ *
+ *   echo <func> > <debugfs>/kamprobes/callgraph   - start profiling func
+ *   echo stop > <debugfs>/kamprobes/callgraph     - stop profiling
+ *   cat <debugfs>/kamprobes/callgraph             - per-cpu edge table
+ *
+ * Call counts are exact. Cycles are inclusive of any time the callee spent
+ * blocked; calls that return on a different cpu than the one they started on
+ * are counted but not timed.
+ *
+ * Restarting on another function restores the previous sites, but their
+ * tables are only released by kamprobes_free, once no task can still be
+ * returning through the old wrappers. The same goes for the wrappers: every
+ * start takes one per call site of func out of the ones reserved by
+ * kamprobes_init (see the max_probes parameter of kamprobes.ko), and they are
+ * not reused by later starts. Once they run out, the remaining sites are left
+ * unprobed, as shown by the probed count in the table header.
+ */
+
+#define CG_STACK_DEPTH 32
+
+int kam_callgraph_start(const char *func);
+void kam_callgraph_stop(void);
+
+int kam_callgraph_init(void);
+void kam_callgraph_free(void);
+
+#endif
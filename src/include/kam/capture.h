@@ -0,0 +1,104 @@
+/**** Notice
+ * capture.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_CAPTURE_H_
+#define _KAM_CAPTURE_H_
+
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+/*
+ * Declarative argument capture
+ *
+ * Instead of on_entry/on_return handlers, a kamprobe can carry a capture spec.
+ * The wrapper generated for such a probe copies the requested argument
+ * registers (optionally dereferenced) and, for call-site probes, the return
+ * value straight into a per-cpu record buffer and then continues into the
+ * original target. No registers are saved and no handler is called: an entry
+ * record costs a few tens of instructions.
+ *
+ * Records are read with kam_capture_read, or as text from
+ * <debugfs>/kamprobes/capture, one line per record:
+ *
+ *   <cpu> <tag> entry|return <value>...
+ *
+ * Limitations:
+ *  - a dereferenced NULL argument is recorded as 0, but other invalid
+ *    pointers are not guarded against; only capture fields of structures
+ *    that are known to be valid kernel memory (or NULL) at the probed site
+ *  - return values can only be captured on call-site probes (ADDR_OF_CALL,
+ *    ADDR_KERNEL_SYSCALL), where the return address is known when generating
+ *    the wrapper
+ */
+
+#define KAM_CAPTURE_MAX_VALS 7
+#define KAM_CAPTURE_MAX_ARGS 6  // rdi, rsi, rdx, rcx, r8, r9
+
+// power of 2, number of records in each per-cpu buffer
+#define KAM_RECORD_BUF_SZ 1024
+
+typedef enum {
+  KAM_REC_ENTRY  = 1,
+  KAM_REC_RETURN = 2
+} kam_record_kind;
+
+#define KAM_REC_INFO(kind, nr_vals) ((kind) | ((nr_vals) << 8))
+#define KAM_REC_KIND(info) ((info) & 0xff)
+#define KAM_REC_NR_VALS(info) (((info) >> 8) & 0xff)
+
+struct kam_capture_val {
+  u8 arg;      // argument index, in ABI order (0 = first argument, in rdi)
+  u8 deref;    // record *(u64 *)(arg + offset) rather than the argument
+  s32 offset;
+};
+
+struct kam_capture {
+  u8 nr_vals;
+  struct kam_capture_val vals[KAM_CAPTURE_MAX_VALS];
+  u8 ret;      // also emit a KAM_REC_RETURN record holding the return value
+};
+typedef struct kam_capture kam_capture;
+
+// the layout is relied upon by the generated code; keep it at 64 bytes
+struct kam_record {
+  u32 tag;
+  u32 info;    // KAM_REC_INFO(kind, nr_vals)
+  u64 vals[KAM_CAPTURE_MAX_VALS];
+};
+typedef struct kam_record kam_record;
+#define KAM_RECORD_SHIFT 6
+
+struct kam_record_cpu {
+  u32 head;                // free running count of reserved records
+  u32 __pad;
+  struct kam_record *recs; // KAM_RECORD_BUF_SZ records
+};
+DECLARE_PER_CPU(struct kam_record_cpu, kam_records);
+
+/*
+ * Copy the records of a cpu written since *pos into out (at most max of them)
+ * and advance *pos. If the buffer wrapped since the last read, the oldest
+ * records are lost and reading restarts from the oldest one still present.
+ *
+ * Records are only guaranteed to be complete when read on their own cpu with
+ * preemption disabled; from other cpus, the most recent record may be torn.
+ */
+int kam_capture_read(int cpu, u32 *pos, kam_record *out, int max);
+
+int kam_capture_init(void);
+// creates <debugfs>/kamprobes/capture, once kam_stats_init made the directory
+int kam_capture_debugfs_init(void);
+void kam_capture_free(void);
+
+struct kamprobe;
+int kam_capture_check(struct kamprobe *probe, u8 *addr);
+char *kam_emit_capture_wrapper(char **wrapper_end, struct kamprobe *probe,
+                               u8 *addr, atomic_t *in_flight);
+
+#endif
@@ -17,7 +17,26 @@
 
 #define CALL_WIDTH 5
 #define JMP_WIDTH 5
-#define MOV_WIDTH 9
+#define MOV_WIDTH 8
+#define INC_WIDTH 7
 
-#define WRAPPER_SIZE 46
+// upper bound for the size of a single wrapper, including the in-flight
+// counter and the saved return address slot placed in front of it
+#define WRAPPER_SIZE 96
+// the same, for wrappers of capture probes (see kam/capture.h)
+#define CAPTURE_WRAPPER_SIZE 320
+// the same, for wrappers of callout probes (see struct kam_callout)
+#define CALLOUT_WRAPPER_SIZE 128
+// the largest of the above; the wrapper arena reserves one slot per probe, so
+// that max_probes probes of any kind fit (the extra words cover the alignment
+// of the in-flight counter)
+#define MAX_WRAPPER_SIZE CAPTURE_WRAPPER_SIZE
+// push + jmp emulating the original call, placed in front of the wrapper
+#define RESUME_STUB_SIZE (5 + JMP_WIDTH)
+#define WRAPPER_SLOT_SIZE (MAX_WRAPPER_SIZE + RESUME_STUB_SIZE + 2 * WORD_SZ)
+
+// when tearing down, poll interval while waiting for tasks blocked inside a
+// probed function to return through the wrappers
+#define DRAIN_POLL_MS 10
+#define DRAIN_WARN_MS 5000
 #endif
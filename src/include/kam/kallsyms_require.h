@@ -13,7 +13,12 @@
   _(can_probe)               \
   _(text_mutex)              \
   _(text_poke)               \
+  _(text_poke_bp)            \
   _(module_alloc)            \
+  _(kallsyms_lookup_size_offset) \
+  _(insn_init)               \
+  _(insn_get_length)         \
+  _(bpf_prog_active)         \
 
 
 #ifdef _once
@@ -25,6 +30,17 @@ _once void* (*KPRIV(module_alloc))(unsigned long size);
 _once int (*KPRIV(can_probe))(unsigned long paddr);
 _once struct mutex *KPRIV(text_mutex);
 _once void* (*KPRIV(text_poke))(void *addr, const void *opcode, size_t len);
+_once void* (*KPRIV(text_poke_bp))(void *addr, const void *opcode, size_t len,
+                                   void *handler);
+_once int (*KPRIV(kallsyms_lookup_size_offset))(unsigned long addr,
+                                               unsigned long *symbolsize,
+                                               unsigned long *offset);
+struct insn;
+_once void (*KPRIV(insn_init))(struct insn *insn, const void *kaddr,
+                               int buf_len, int x86_64);
+_once void (*KPRIV(insn_get_length))(struct insn *insn);
+// per-cpu, see trace_call_bpf
+_once int __percpu *KPRIV(bpf_prog_active);
 #endif
 
 #endif
@@ -10,10 +10,12 @@
 #ifndef _RSCFL_KAMPROBES_H_
 #define _RSCFL_KAMPROBES_H_
 
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/types.h>
 
+#include "kam/capture.h"
 #include "kam/constants.h"
 #include "ldry/macros/unused.h"
 #include "ldry/macros/bits.h"
@@ -60,7 +62,8 @@ The codification of roles is as follows:
                          //    the bit will be 1 for module probes
 #define ADDR_FIXED_BITS (ADDR_TYPE_BITS + ADDR_LOC_BITS)
 #define ADDR_TYPE_MASK SET_ALL_BITS(ADDR_TYPE_BITS)
-#define ADDR_LOC_MASK SET_ALL_BITS(ADDR_LOC_BITS) << ADDR_TYPE_BITS
+#define ADDR_LOC_MASK (SET_ALL_BITS(ADDR_LOC_BITS) << ADDR_TYPE_BITS)
+#define ADDR_LOC(type) (((type) & ADDR_LOC_MASK) >> ADDR_TYPE_BITS)
 #define SUBSYS_PROBE_TYPE(subtype, loc, addr_type)   \
         (subtype << ADDR_FIXED_BITS) | (loc << ADDR_TYPE_BITS) | addr_type
 
@@ -72,6 +75,48 @@ typedef enum {
   PROBE_REMOVED
 } kamprobe_state;
 
+/*
+ * Per-probe options (kamprobe.flags)
+ *
+ * PROBE_DIRECT: for call-site probes without an on_return handler, generate a
+ *   minimal wrapper that calls on_entry with a normal call and then jumps to
+ *   the original target. The pre-handler is written as usual, with the
+ *   KAM_PRE_ENTRY/KAM_PRE_RETURN macros, but its return value is ignored and,
+ *   because of the extra return address, arguments passed on the stack (beyond
+ *   the 6th) are found 8 bytes further than in the original function.
+ */
+typedef enum {
+  PROBE_DIRECT = 1 << 0
+} kamprobe_flags;
+
+/*
+ * Callout probes
+ *
+ * The wrapper saves the argument registers on the stack and calls plain C
+ * functions (no KAM_PRE_ENTRY macros needed), passing them the saved registers
+ * and a per-probe data word. On the return path, regs->ax holds the return
+ * value. Changes made to regs are not propagated to the probed function.
+ *
+ * As for capture probes, on_return is only supported on call-site probes.
+ */
+struct kam_regs {
+  u64 ax;
+  u64 r9;
+  u64 r8;
+  u64 cx;
+  u64 dx;
+  u64 si;
+  u64 di;
+};
+typedef void (*kam_callout_fn)(struct kam_regs *regs, unsigned long data);
+
+struct kam_callout {
+  kam_callout_fn on_entry;
+  kam_callout_fn on_return;
+  unsigned long data;
+};
+typedef struct kam_callout kam_callout;
+
 typedef enum {
   MODULE_INIT,
   MODULE_CORE
@@ -90,19 +135,47 @@ struct kamprobe {
   kamprobe_state state;
 
   char addr_type;
+  unsigned char flags; // kamprobe_flags
   union {
     u8 *addr;
     module_addr m_addr; // the probe is set on a kernel module
   };
-  unsigned char orig_code[CALL_WIDTH];
 
-  unsigned char *probe_code;
+  // set by kamprobe_register, for information only
+  u8 *site;                  // resolved address of the patched instruction
+  unsigned char *probe_code; // start of the wrapper generated for the probe
+  unsigned short wrapper_sz; // bytes emitted for the wrapper
 
   void *on_entry;
   void *on_return;
+  kam_capture *capture; // if set, used instead of on_entry/on_return
+  kam_callout callout;  // if any handler set, used instead of on_entry/on_return
 };
 typedef struct kamprobe kamprobe;
 
+/*
+ * kamprobes' own record of a generated wrapper. Records are kept until
+ * kamprobes_free, whatever happens to the kamprobe they were generated for,
+ * as tasks blocked inside a probed function may still return through the
+ * wrapper after the probe is unregistered.
+ */
+struct kam_wrapper {
+  kamprobe *probe;           // NULL once unregistered
+  int tag;
+  char addr_type;
+  kamprobe_state state;      // PROBE_ACTIVE or PROBE_REMOVED
+  int pending;               // to be patched or restored, under kamprobes_lock
+  u8 *site;
+  unsigned char orig_code[CALL_WIDTH];
+  unsigned char *code;
+  unsigned short size;
+  u8 *resume;                // where cpus trapping on the site while it is
+                             // poked continue, see poke_site in probes.c
+  atomic_t *in_flight;       // tasks that will return through the wrapper
+                             // (NULL for wrappers without a return path)
+  struct hlist_node site_node;
+};
+
 
 /*
  * Definitions for the probe-handler api
@@ -175,12 +248,31 @@ asm __volatile__("" :: "m" (__rscfl_reserved_stack)); /* prevent optim */    \
   asm("pop %rax;")            \
 
 
+/*
+ * Prepare for registering up to max_probes probes, of any kind. The wrapper
+ * arena takes WRAPPER_SLOT_SIZE bytes per probe (see kam/constants.h).
+ */
 int kamprobes_init(int max_probes);
+
+/*
+ * The kamprobe must stay valid and unchanged while registered. kamprobes
+ * keeps no reference to it once kamprobe_unregister (or one of the batch
+ * variants, kamprobes_unregister_all or kamprobes_free) returns, after which
+ * it may be freed or registered again. Registering a kamprobe that is already
+ * registered fails with -EBUSY. Every registration takes a new wrapper, which
+ * stays reserved until kamprobes_free.
+ */
 int kamprobe_register(kamprobe *probe);
+int kamprobes_register_batch(kamprobe **probes, unsigned int nr);
 
 int kamprobe_unregister(kamprobe *probe);
+int kamprobes_unregister_batch(kamprobe **probes, unsigned int nr);
 void kamprobes_unregister_all(void);
 void kamprobes_free(void);
 
+// iterate over the wrappers generated since kamprobes_init
+unsigned int kamprobes_count(void);
+const struct kam_wrapper *kamprobes_get(unsigned int i);
+
 
 #endif
@@ -0,0 +1,64 @@
+/**** Notice
+ * stats.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_STATS_H_
+#define _KAM_STATS_H_
+
+#include <linux/types.h>
+
+/*
+ * Self-instrumentation of kamprobes, exposed through debugfs:
+ *
+ *   <debugfs>/kamprobes/stats   - wrapper arena usage, rejected registrations
+ *                                 by reason, active probes by address type and
+ *                                 latency histograms (log2 buckets, in ns,
+ *                                 after the number of events of each kind)
+ *   <debugfs>/kamprobes/probes  - one line per registered probe, with the size
+ *                                 of its wrapper
+ *
+ * The counters are updated under the kamprobes registration lock (see
+ * probes.c) and read without it.
+ */
+
+typedef enum {
+  REJECT_NOT_CALL_NOP,
+  REJECT_MODULE_MISSING,
+  REJECT_DUPLICATE,
+  REJECT_NO_SPACE,
+  REJECT_INVALID_SPEC,
+  REJECT_REASONS
+} kam_reject_reason;
+
+/*
+ * LAT_REGISTER: generating the wrapper of one probe (both registration paths)
+ * LAT_PATCH, LAT_RESTORE: one stop_machine() pass over a batch of sites
+ * LAT_POKE: patching or restoring a single site with text_poke_bp()
+ */
+typedef enum {
+  LAT_REGISTER,
+  LAT_PATCH,
+  LAT_RESTORE,
+  LAT_POKE,
+  LAT_KINDS
+} kam_latency_kind;
+
+#define KAM_LAT_BUCKETS 32
+
+void kam_stats_reject(kam_reject_reason reason);
+void kam_stats_latency(kam_latency_kind kind, u64 ns);
+void kam_stats_arena(size_t used, size_t total);
+void kam_stats_active(char addr_type, int delta);
+
+int kam_stats_init(void);
+void kam_stats_free(void);
+
+struct dentry;
+struct dentry *kam_stats_debugfs_dir(void);
+
+#endif
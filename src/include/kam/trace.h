@@ -0,0 +1,189 @@
+/**** Notice
+ * trace.h: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#ifndef _KAM_TRACE_H_
+#define _KAM_TRACE_H_
+
+#include <linux/types.h>
+
+/*
+ * Compact binary trace format
+ *
+ * Handlers record events (tag, timestamp, pid, up to 7 u64 arguments) with
+ * kam_trace_event(). Events are encoded into per-cpu chunks, each starting
+ * with a struct kam_trace_chunk header followed by size bytes of events:
+ *
+ *   varint  head            idx << 5 | KAM_TRACE_NEW_TAG | KAM_TRACE_PID |
+ *                           nr_args
+ *   varint  tag             only with KAM_TRACE_NEW_TAG
+ *   varint  delta_ts        ns since the previous event (base_ts for the first)
+ *   varint  pid             only with KAM_TRACE_PID
+ *   varint  args[nr_args]
+ *
+ * idx indexes the tag dictionary of the chunk. An event with KAM_TRACE_NEW_TAG
+ * defines the next entry, which is also the one it uses. The pid is only
+ * present when it differs from the pid of the previous event in the chunk. It
+ * is always present in the first event. Varints are LEB128: 7 bits per byte,
+ * least significant group first, with the top bit set on all but the last
+ * byte.
+ *
+ * Chunks are self-contained and can be decoded in any order. seq counts the
+ * chunks of each cpu, so gaps show where chunks were overwritten before being
+ * read. Timestamps come from a clock shared by all cpus, so events can be
+ * merged into a single ordered stream (see src/tools/kamtrace.c).
+ * src/tests/kamtrace-test.c checks that the decoder gives back what the
+ * encoder below was given.
+ *
+ * Reading <debugfs>/kamprobes/trace returns and consumes the chunks of all
+ * cpus. The chunks being written are closed first, so one read sees every
+ * event recorded before it. The data is a plain sequence of chunks:
+ *
+ *   cat <debugfs>/kamprobes/trace > trace.bin
+ *   kamtrace trace.bin         # time-ordered events
+ *   kamtrace -s trace.bin      # per-tag summary
+ */
+
+#define KAM_TRACE_MAGIC 0x6b616d74 // "kamt"
+#define KAM_TRACE_VERSION 1
+
+#define KAM_TRACE_NR_ARGS_MASK 0x07
+#define KAM_TRACE_PID          0x08
+#define KAM_TRACE_NEW_TAG      0x10
+#define KAM_TRACE_IDX_SHIFT    5
+#define KAM_TRACE_MAX_ARGS     7
+
+// tag dictionary entries per chunk; a chunk is closed when it runs out
+#define KAM_TRACE_DICT_SZ 64
+// bytes of a chunk, header included
+#define KAM_TRACE_CHUNK_SZ 4096
+// worst case size of an encoded event
+#define KAM_TRACE_MAX_EVENT (5 + 5 + 10 + 5 + KAM_TRACE_MAX_ARGS * 10)
+
+struct kam_trace_chunk {
+  __u32 magic;
+  __u16 version;
+  __u16 cpu;
+  __u32 size;      // bytes of events following the header
+  __u32 nr_events;
+  __u64 base_ts;   // ns
+  __u64 seq;
+};
+
+static inline __u8 *kam_varint_put(__u8 *p, __u64 v)
+{
+  while (v >= 0x80) {
+    *p++ = (__u8)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (__u8)v;
+  return p;
+}
+
+// returns NULL if the varint is truncated or longer than 64 bits
+static inline const __u8 *kam_varint_get(const __u8 *p, const __u8 *end,
+                                         __u64 *v)
+{
+  unsigned int shift = 0;
+
+  *v = 0;
+  while (p < end && shift < 64) {
+    *v |= (__u64)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80))
+      return p;
+    shift += 7;
+  }
+  return NULL;
+}
+
+/*
+ * Encoder state for the chunk being written. Callers check that the chunk has
+ * room for KAM_TRACE_MAX_EVENT bytes and that kam_trace_enc_find() did not
+ * return KAM_TRACE_DICT_SZ, or else close the chunk and start a new one with
+ * kam_trace_enc_reset() before calling kam_trace_encode().
+ */
+struct kam_trace_enc {
+  __u64 last_ts;
+  __u32 last_pid;
+  int have_pid;
+  unsigned int nr_tags;
+  __u32 tags[KAM_TRACE_DICT_SZ];
+};
+
+static inline void kam_trace_enc_reset(struct kam_trace_enc *enc, __u64 base_ts)
+{
+  enc->last_ts = base_ts;
+  enc->have_pid = 0;
+  enc->nr_tags = 0;
+}
+
+// dictionary index of tag; nr_tags if it is not defined yet
+static inline unsigned int kam_trace_enc_find(const struct kam_trace_enc *enc,
+                                              __u32 tag)
+{
+  unsigned int i;
+
+  for (i = 0; i < enc->nr_tags; i++) {
+    if (enc->tags[i] == tag)
+      break;
+  }
+  return i;
+}
+
+// returns the end of the encoded event
+static inline __u8 *kam_trace_encode(struct kam_trace_enc *enc, __u8 *p,
+                                     __u32 tag, __u64 ts, __u32 pid,
+                                     unsigned int nr_args, const __u64 *args)
+{
+  unsigned int idx = kam_trace_enc_find(enc, tag), i;
+  __u64 head = (__u64)idx << KAM_TRACE_IDX_SHIFT | nr_args;
+
+  if (idx == enc->nr_tags)
+    head |= KAM_TRACE_NEW_TAG;
+  if (!enc->have_pid || pid != enc->last_pid)
+    head |= KAM_TRACE_PID;
+
+  p = kam_varint_put(p, head);
+  if (head & KAM_TRACE_NEW_TAG) {
+    p = kam_varint_put(p, tag);
+    enc->tags[enc->nr_tags++] = tag;
+  }
+  // deltas are unsigned: a clock stepping back is recorded as no time passing
+  if (ts < enc->last_ts)
+    ts = enc->last_ts;
+  p = kam_varint_put(p, ts - enc->last_ts);
+  enc->last_ts = ts;
+  if (head & KAM_TRACE_PID) {
+    p = kam_varint_put(p, pid);
+    enc->last_pid = pid;
+    enc->have_pid = 1;
+  }
+  for (i = 0; i < nr_args; i++)
+    p = kam_varint_put(p, args[i]);
+  return p;
+}
+
+#ifdef __KERNEL__
+
+// chunks kept for each cpu, the oldest unread ones are overwritten first
+#define KAM_TRACE_CHUNKS 64
+
+/*
+ * Record an event on the current cpu. Usable from any handler, including in
+ * interrupt context (but not from NMIs, where events are dropped). nr_args
+ * must be at most KAM_TRACE_MAX_ARGS. The per-cpu chunks are allocated after
+ * the first event, which is dropped, as are the ones recorded in the
+ * meantime.
+ */
+void kam_trace_event(u32 tag, unsigned int nr_args, const u64 *args);
+
+int kam_trace_init(void);
+void kam_trace_free(void);
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/**** Notice
+ * acct.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* Per-task accounting areas (see kam/acct.h)
+ *
+ * Mapping /dev/kam_acct allocates a zeroed page for the calling thread and
+ * inserts it into a hash table keyed by the thread's struct pid (we hold a
+ * reference to it, so the key cannot be reused by another thread). Probe
+ * handlers look the current thread up under RCU and update its page. The
+ * entry goes away when the mapping is torn down (munmap or process exit).
+ */
+#include "kam/acct.h"
+
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timex.h>
+
+struct acct_task {
+  struct hlist_node node;
+  struct pid *pid;
+  struct page *page;
+  struct kam_acct_page *acct;
+  int mappings;                       // under acct_lock
+  u32 depth[KAM_ACCT_SUBTYPES];       // kernel-only nesting state
+  cycles_t start[KAM_ACCT_SUBTYPES];
+  struct rcu_head rcu;
+};
+
+#define ACCT_HASH_BITS 10
+static DEFINE_HASHTABLE(acct_tasks, ACCT_HASH_BITS);
+static DEFINE_SPINLOCK(acct_lock);
+
+static struct acct_task *find_task(struct pid *pid)
+{
+  struct acct_task *t;
+
+  hash_for_each_possible_rcu(acct_tasks, t, node, (unsigned long)pid) {
+    if (t->pid == pid)
+      return t;
+  }
+  return NULL;
+}
+
+void kam_acct_enter(u8 subtype)
+{
+  struct acct_task *t;
+
+  if (!in_task() || subtype >= KAM_ACCT_SUBTYPES)
+    return;
+  rcu_read_lock();
+  t = find_task(task_pid(current));
+  if (t != NULL) {
+    t->acct->sub[subtype].calls++;
+    if (t->depth[subtype]++ == 0)
+      t->start[subtype] = get_cycles();
+  }
+  rcu_read_unlock();
+}
+EXPORT_SYMBOL(kam_acct_enter);
+
+void kam_acct_exit(u8 subtype)
+{
+  struct acct_task *t;
+
+  if (!in_task() || subtype >= KAM_ACCT_SUBTYPES)
+    return;
+  rcu_read_lock();
+  t = find_task(task_pid(current));
+  // depth is 0 if the page was mapped while inside the subsystem
+  if (t != NULL && t->depth[subtype] > 0 && --t->depth[subtype] == 0)
+    t->acct->sub[subtype].cycles += get_cycles() - t->start[subtype];
+  rcu_read_unlock();
+}
+EXPORT_SYMBOL(kam_acct_exit);
+
+void kam_acct_callout_enter(struct kam_regs *regs, unsigned long subtype)
+{
+  kam_acct_enter(subtype);
+}
+EXPORT_SYMBOL(kam_acct_callout_enter);
+
+void kam_acct_callout_exit(struct kam_regs *regs, unsigned long subtype)
+{
+  kam_acct_exit(subtype);
+}
+EXPORT_SYMBOL(kam_acct_callout_exit);
+
+static void free_task_rcu(struct rcu_head *head)
+{
+  struct acct_task *t = container_of(head, struct acct_task, rcu);
+
+  put_pid(t->pid);
+  // the page itself stays around while still mapped
+  __free_page(t->page);
+  kfree(t);
+}
+
+// vma copied by mremap
+static void acct_vma_open(struct vm_area_struct *vma)
+{
+  struct acct_task *t = vma->vm_private_data;
+
+  spin_lock(&acct_lock);
+  t->mappings++;
+  spin_unlock(&acct_lock);
+}
+
+static void acct_vma_close(struct vm_area_struct *vma)
+{
+  struct acct_task *t = vma->vm_private_data;
+  int last;
+
+  spin_lock(&acct_lock);
+  last = --t->mappings == 0;
+  if (last)
+    hash_del_rcu(&t->node);
+  spin_unlock(&acct_lock);
+
+  if (last)
+    call_rcu(&t->rcu, free_task_rcu);
+}
+
+static const struct vm_operations_struct acct_vm_ops = {
+  .open  = acct_vma_open,
+  .close = acct_vma_close,
+};
+
+static struct acct_task *alloc_task(void)
+{
+  struct acct_task *t = kzalloc(sizeof(*t), GFP_KERNEL);
+
+  if (t == NULL)
+    return NULL;
+  t->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+  if (t->page == NULL) {
+    kfree(t);
+    return NULL;
+  }
+  t->acct = page_address(t->page);
+  t->acct->version = KAM_ACCT_VERSION;
+  t->acct->nr_subtypes = KAM_ACCT_SUBTYPES;
+  t->pid = get_task_pid(current, PIDTYPE_PID);
+  return t;
+}
+
+static int acct_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct pid *pid = task_pid(current);
+  struct acct_task *t, *new_t;
+  int rc;
+
+  if (vma->vm_end - vma->vm_start != PAGE_SIZE || vma->vm_pgoff != 0)
+    return -EINVAL;
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+
+  // allocate outside the lock; dropped if the thread mapped its page already
+  new_t = alloc_task();
+  if (new_t == NULL)
+    return -ENOMEM;
+
+  spin_lock(&acct_lock);
+  t = find_task(pid);
+  if (t == NULL) {
+    t = new_t;
+    new_t = NULL;
+    hash_add_rcu(acct_tasks, &t->node, (unsigned long)t->pid);
+  }
+  t->mappings++;
+  spin_unlock(&acct_lock);
+
+  if (new_t != NULL) {
+    put_pid(new_t->pid);
+    __free_page(new_t->page);
+    kfree(new_t);
+  }
+
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+  vma->vm_private_data = t;
+  vma->vm_ops = &acct_vm_ops;
+
+  rc = vm_insert_page(vma, vma->vm_start, t->page);
+  if (rc)
+    acct_vma_close(vma);
+  return rc;
+}
+
+static const struct file_operations acct_fops = {
+  .owner = THIS_MODULE,
+  .mmap  = acct_mmap,
+};
+
+static struct miscdevice acct_dev = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = KAM_ACCT_DEVICE,
+  .fops  = &acct_fops,
+  .mode  = 0444,
+};
+
+int kam_acct_init(void)
+{
+  return misc_register(&acct_dev);
+}
+
+/*
+ * Existing mappings keep the module pinned through their file and release
+ * their pages when unmapped; only new mappings are prevented here. Waits for
+ * the entries of mappings closed so far to be freed.
+ */
+void kam_acct_free(void)
+{
+  misc_deregister(&acct_dev);
+  rcu_barrier();
+}
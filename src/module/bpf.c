@@ -0,0 +1,341 @@
+/**** Notice
+ * bpf.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* eBPF programs as probe handlers (see kam/bpf.h)
+ *
+ * Each attached probe is a callout probe whose data word points to a link
+ * holding the two programs. The callouts build a struct pt_regs from the saved
+ * argument registers and run the program under rcu_read_lock with preemption
+ * disabled and the kernel's bpf_prog_active guard taken, the way kprobe
+ * programs are run by trace_call_bpf.
+ *
+ * Probes are registered and unregistered through kamprobe_register and
+ * kamprobe_unregister, which serialize against every other caller with the
+ * kamprobes registration lock. bpf_lock only guards bpf_links and bpf_next_id,
+ * and is taken before that lock when both are held.
+ *
+ * Detaching restores the site, clears the program pointers and drops the
+ * program references after a grace period. The link itself is kept until
+ * kamprobes_free: tasks blocked inside the callee will still return through
+ * the wrapper, which passes the link to the return callout.
+ */
+#include "kam/bpf.h"
+
+#include <asm/insn.h>
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/kallsyms.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "kam/asm2bin.h"
+#include "kam/kallsyms_config.h"
+#include "kam/probes.h"
+
+#ifdef CONFIG_BPF_SYSCALL
+#include <linux/bpf.h>
+#include <linux/filter.h>
+
+enum { BPF_ENTRY, BPF_RETURN, BPF_PROGS };
+
+struct kam_bpf_link {
+  struct list_head list;
+  u32 id;
+  kamprobe probe;
+  struct bpf_prog __rcu *progs[BPF_PROGS];
+};
+
+static DEFINE_MUTEX(bpf_lock);          // bpf_links, bpf_next_id
+static LIST_HEAD(bpf_links);
+static u32 bpf_next_id = 0;
+
+static void run_prog(struct kam_bpf_link *link, int which,
+                     struct kam_regs *regs)
+{
+  struct bpf_prog *prog;
+  struct pt_regs ctx;
+
+  // shared with kprobe and tracepoint programs, as in trace_call_bpf: a
+  // program must not run while another one holds map locks on this cpu
+  preempt_disable();
+  if (__this_cpu_inc_return(*KPRIV(bpf_prog_active)) != 1)
+    goto out;
+
+  rcu_read_lock();
+  prog = rcu_dereference(link->progs[which]);
+  if (prog != NULL) {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.di = regs->di;
+    ctx.si = regs->si;
+    ctx.dx = regs->dx;
+    ctx.cx = regs->cx;
+    ctx.r8 = regs->r8;
+    ctx.r9 = regs->r9;
+    ctx.ax = regs->ax;
+    // the return address (entry) or the return path padding (return) is
+    // stored right above the saved registers, see emit_callout
+    if (which == BPF_ENTRY) {
+      ctx.ip = (unsigned long)link->probe.site;
+      ctx.sp = (unsigned long)(regs + 1);
+    } else {
+      ctx.ip = (unsigned long)link->probe.site + CALL_WIDTH;
+      ctx.sp = (unsigned long)(regs + 1) + WORD_SZ;
+    }
+    BPF_PROG_RUN(prog, &ctx);
+  }
+  rcu_read_unlock();
+
+out:
+  __this_cpu_dec(*KPRIV(bpf_prog_active));
+  preempt_enable();
+}
+
+static void bpf_entry(struct kam_regs *regs, unsigned long data)
+{
+  run_prog((struct kam_bpf_link *)data, BPF_ENTRY, regs);
+}
+
+static void bpf_return(struct kam_regs *regs, unsigned long data)
+{
+  run_prog((struct kam_bpf_link *)data, BPF_RETURN, regs);
+}
+
+static struct bpf_prog *get_prog(int fd)
+{
+  if (fd < 0)
+    return NULL;
+  return bpf_prog_get_type(fd, BPF_PROG_TYPE_KPROBE);
+}
+
+static void put_progs(struct kam_bpf_link *link)
+{
+  struct bpf_prog *prog;
+  int i;
+
+  for (i = 0; i < BPF_PROGS; i++) {
+    prog = rcu_dereference_protected(link->progs[i], 1);
+    if (prog != NULL)
+      bpf_prog_put(prog);
+  }
+}
+
+/*
+ * Offsets come from userspace: only accept one that starts an instruction of
+ * the function, found by decoding it from the start as find_call_sites does
+ * in callgraph.c, and only if that instruction is a call or a nop that can be
+ * patched as a whole.
+ */
+static int check_site(u8 *func, unsigned long size, u32 offset)
+{
+  struct insn insn;
+  u8 *p = func;
+
+  if (offset >= size || size - offset < CALL_WIDTH)
+    return -EINVAL;
+  for (;;) {
+    KPRIV(insn_init)(&insn, p, MAX_INSN_SIZE, 1);
+    KPRIV(insn_get_length)(&insn);
+    if (insn.length == 0)
+      return -EILSEQ;
+    if (p == func + offset)
+      break;
+    p += insn.length;
+    if (p > func + offset)
+      return -EINVAL;
+  }
+  if (insn.length != CALL_WIDTH || (!is_call_insn(p) && !is_noop(p)))
+    return -EINVAL;
+  return 0;
+}
+
+static int bpf_attach(struct kam_bpf_attach *at)
+{
+  unsigned long addr, size, offset;
+  struct bpf_prog *progs[BPF_PROGS];
+  struct kam_bpf_link *link;
+  int type = at->addr_type & ADDR_TYPE_MASK;
+  int rc;
+
+  at->sym[KAM_BPF_SYM_LEN - 1] = '\0';
+  if (type != ADDR_OF_CALL && type != ADDR_OF_FUNC)
+    return -EINVAL;
+  if (at->entry_fd < 0 && at->return_fd < 0)
+    return -EINVAL;
+  addr = kallsyms_lookup_name(at->sym);
+  if (addr == 0 ||
+      !KPRIV(kallsyms_lookup_size_offset)(addr, &size, &offset))
+    return -ENOENT;
+  rc = check_site((u8 *)addr, size, at->offset);
+  if (rc)
+    return rc;
+
+  progs[BPF_ENTRY] = get_prog(at->entry_fd);
+  if (IS_ERR(progs[BPF_ENTRY]))
+    return PTR_ERR(progs[BPF_ENTRY]);
+  progs[BPF_RETURN] = get_prog(at->return_fd);
+  if (IS_ERR(progs[BPF_RETURN])) {
+    rc = PTR_ERR(progs[BPF_RETURN]);
+    goto fail_put;
+  }
+
+  link = kzalloc(sizeof(*link), GFP_KERNEL);
+  if (link == NULL) {
+    rc = -ENOMEM;
+    goto fail_put;
+  }
+  RCU_INIT_POINTER(link->progs[BPF_ENTRY], progs[BPF_ENTRY]);
+  RCU_INIT_POINTER(link->progs[BPF_RETURN], progs[BPF_RETURN]);
+  link->probe = (kamprobe){.state = PROBE_NO_HANDLERS,
+                           .addr = (u8 *)addr + at->offset,
+                           // absolute address, even for sites in modules
+                           .addr_type = at->addr_type & ~ADDR_LOC_MASK,
+                          };
+  if (progs[BPF_ENTRY] != NULL)
+    link->probe.callout.on_entry = bpf_entry;
+  if (progs[BPF_RETURN] != NULL)
+    link->probe.callout.on_return = bpf_return;
+  link->probe.callout.data = (unsigned long)link;
+
+  mutex_lock(&bpf_lock);
+  link->id = bpf_next_id++;
+  mutex_unlock(&bpf_lock);
+  link->probe.tag = link->id;
+  rc = kamprobe_register(&link->probe);
+  if (rc) {
+    kfree(link);
+    goto fail_put;
+  }
+  // the open device file pins the module, so kam_bpf_free runs after this
+  mutex_lock(&bpf_lock);
+  list_add(&link->list, &bpf_links);
+  mutex_unlock(&bpf_lock);
+
+  at->id = link->id;
+  return 0;
+
+fail_put:
+  if (!IS_ERR_OR_NULL(progs[BPF_ENTRY]))
+    bpf_prog_put(progs[BPF_ENTRY]);
+  if (!IS_ERR_OR_NULL(progs[BPF_RETURN]))
+    bpf_prog_put(progs[BPF_RETURN]);
+  return rc;
+}
+
+static int bpf_detach(u32 id)
+{
+  struct kam_bpf_link *link;
+  struct bpf_prog *progs[BPF_PROGS];
+  int i, rc = -ENOENT;
+
+  mutex_lock(&bpf_lock);
+  list_for_each_entry(link, &bpf_links, list) {
+    if (link->id != id)
+      continue;
+    rc = kamprobe_unregister(&link->probe);
+    if (rc)
+      break;
+    // tasks blocked inside the callee still return into bpf_return, which
+    // must find the pointer cleared once the grace period is over
+    for (i = 0; i < BPF_PROGS; i++) {
+      progs[i] = rcu_dereference_protected(link->progs[i],
+                                           lockdep_is_held(&bpf_lock));
+      RCU_INIT_POINTER(link->progs[i], NULL);
+    }
+    // run_prog holds rcu_read_lock for as long as it uses a program
+    synchronize_rcu();
+    for (i = 0; i < BPF_PROGS; i++) {
+      if (progs[i] != NULL)
+        bpf_prog_put(progs[i]);
+    }
+    break;
+  }
+  mutex_unlock(&bpf_lock);
+  return rc;
+}
+
+static long bpf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct kam_bpf_attach at;
+  u32 id;
+  int rc;
+
+  if (!capable(CAP_SYS_ADMIN))
+    return -EPERM;
+
+  switch (cmd) {
+  case KAM_BPF_ATTACH:
+    if (copy_from_user(&at, (void __user *)arg, sizeof(at)))
+      return -EFAULT;
+    rc = bpf_attach(&at);
+    if (rc == 0 && copy_to_user((void __user *)arg, &at, sizeof(at))) {
+      bpf_detach(at.id);
+      rc = -EFAULT;
+    }
+    return rc;
+  case KAM_BPF_DETACH:
+    if (get_user(id, (u32 __user *)arg))
+      return -EFAULT;
+    return bpf_detach(id);
+  default:
+    return -ENOTTY;
+  }
+}
+
+static const struct file_operations bpf_fops = {
+  .owner          = THIS_MODULE,
+  .unlocked_ioctl = bpf_ioctl,
+};
+
+static struct miscdevice bpf_dev = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = KAM_BPF_DEVICE,
+  .fops  = &bpf_fops,
+  .mode  = 0600,
+};
+
+int kam_bpf_init(void)
+{
+  return misc_register(&bpf_dev);
+}
+
+/*
+ * Called by kamprobes_free, once the sites are restored and no task can be
+ * running inside the wrappers anymore.
+ */
+void kam_bpf_free(void)
+{
+  struct kam_bpf_link *link, *tmp;
+
+  misc_deregister(&bpf_dev);
+  mutex_lock(&bpf_lock);
+  list_for_each_entry_safe(link, tmp, &bpf_links, list) {
+    list_del(&link->list);
+    put_progs(link);
+    kfree(link);
+  }
+  mutex_unlock(&bpf_lock);
+}
+
+#else /* !CONFIG_BPF_SYSCALL */
+
+int kam_bpf_init(void)
+{
+  return -EOPNOTSUPP;
+}
+
+void kam_bpf_free(void)
+{
+}
+
+#endif
@@ -0,0 +1,351 @@
+/**** Notice
+ * callgraph.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* Call-edge profiling mode (see kam/callgraph.h)
+ *
+ * Every call site found in the profiled function gets a callout probe whose
+ * data word points to the description of the edge. On entry, the edge
+ * counter of the current cpu is incremented and a (task, edge, start cycles)
+ * frame is pushed on a per-cpu shadow stack; on return, the frame of the
+ * same task and edge is removed and the elapsed cycles are added to the edge.
+ * Counters and stacks are also updated from interrupt context, so the stack
+ * updates run with interrupts disabled.
+ *
+ * Tasks blocking or preempted inside a callee leave their frames on the stack
+ * while other tasks run, so frames of different tasks interleave: removing a
+ * frame keeps the frames of other tasks above it and only drops the ones of
+ * the returning task, which are stale. A task may also resume on another cpu,
+ * leaving its frame behind; its return then finds no frame and only counts.
+ * When the stack is full, the oldest frame, the most likely to be stale, is
+ * dropped to make room.
+ */
+#include "kam/callgraph.h"
+
+#include <asm/insn.h>
+#include <linux/debugfs.h>
+#include <linux/kallsyms.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "kam/asm2bin.h"
+#include "kam/kallsyms_config.h"
+#include "kam/probes.h"
+#include "kam/stats.h"
+
+struct cg_stat {
+  u64 calls;
+  u64 cycles;
+};
+
+struct cg_session;
+
+struct cg_edge {
+  struct cg_session *session;
+  unsigned int idx;
+  u8 *callee;
+};
+
+struct cg_frame {
+  struct task_struct *task; // only compared, never dereferenced
+  struct cg_edge *edge;
+  cycles_t start;
+};
+
+struct cg_stack {
+  int depth;
+  struct cg_frame frames[CG_STACK_DEPTH];
+};
+
+// one profiling run, on one function
+struct cg_session {
+  struct list_head list;
+  char func[KSYM_NAME_LEN];
+  unsigned int nr_edges;
+  unsigned int nr_probed;
+  kamprobe *probes;
+  kamprobe **probe_ptrs;
+  struct cg_edge *edges;
+  struct cg_stat __percpu *stats;  // nr_edges entries on each cpu
+};
+
+static DEFINE_PER_CPU(struct cg_stack, cg_stacks);
+static DEFINE_MUTEX(cg_lock);
+// sessions are kept until kamprobes_free, see kam/callgraph.h
+static LIST_HEAD(cg_sessions);
+static struct cg_session *cg_current = NULL;
+
+static void cg_enter(struct kam_regs *regs, unsigned long data)
+{
+  struct cg_edge *edge = (struct cg_edge *)data;
+  struct cg_stack *st;
+  unsigned long flags;
+
+  this_cpu_inc(edge->session->stats[edge->idx].calls);
+  // an interrupt may go through another profiled edge
+  local_irq_save(flags);
+  st = this_cpu_ptr(&cg_stacks);
+  if (st->depth == CG_STACK_DEPTH) {
+    memmove(&st->frames[0], &st->frames[1],
+            (CG_STACK_DEPTH - 1) * sizeof(st->frames[0]));
+    st->depth--;
+  }
+  st->frames[st->depth].task = current;
+  st->frames[st->depth].edge = edge;
+  st->frames[st->depth].start = get_cycles();
+  st->depth++;
+  local_irq_restore(flags);
+}
+
+static void cg_exit(struct kam_regs *regs, unsigned long data)
+{
+  struct cg_edge *edge = (struct cg_edge *)data;
+  cycles_t now = get_cycles();
+  struct cg_stack *st;
+  unsigned long flags;
+  int i, j, k;
+
+  local_irq_save(flags);
+  st = this_cpu_ptr(&cg_stacks);
+  for (i = st->depth - 1; i >= 0; i--) {
+    if (st->frames[i].edge != edge || st->frames[i].task != current)
+      continue;
+    __this_cpu_add(edge->session->stats[edge->idx].cycles,
+                   now - st->frames[i].start);
+    for (j = i + 1, k = i; j < st->depth; j++) {
+      if (st->frames[j].task != current)
+        st->frames[k++] = st->frames[j];
+    }
+    st->depth = k;
+    break;
+  }
+  local_irq_restore(flags);
+}
+
+/*
+ * Walk the instructions of [start, start + size) and store the address of the
+ * direct calls found into sites (if not NULL). Returns the number of calls, or
+ * a negative error if the body cannot be decoded.
+ */
+static int find_call_sites(u8 *start, unsigned long size, u8 **sites)
+{
+  struct insn insn;
+  u8 *p = start;
+  int nr = 0;
+
+  while (p < start + size) {
+    KPRIV(insn_init)(&insn, p, MAX_INSN_SIZE, 1);
+    KPRIV(insn_get_length)(&insn);
+    if (insn.length == 0)
+      return -EILSEQ;
+    // the call at offset 0 is __fentry__, owned by ftrace
+    if (p != start && insn.length == CALL_WIDTH && is_call_insn(p)) {
+      if (sites != NULL)
+        sites[nr] = p;
+      nr++;
+    }
+    p += insn.length;
+  }
+  return nr;
+}
+
+static void free_session(struct cg_session *s)
+{
+  free_percpu(s->stats);
+  vfree(s->edges);
+  vfree(s->probe_ptrs);
+  vfree(s->probes);
+  kfree(s);
+}
+
+int kam_callgraph_start(const char *func)
+{
+  unsigned long addr, size, offset;
+  struct cg_session *s;
+  u8 **sites;
+  int nr, i, rc;
+
+  addr = kallsyms_lookup_name(func);
+  if (addr == 0 ||
+      !KPRIV(kallsyms_lookup_size_offset)(addr, &size, &offset))
+    return -ENOENT;
+
+  nr = find_call_sites((u8 *)addr, size, NULL);
+  if (nr <= 0)
+    return nr ? nr : -ENOENT;
+
+  s = kzalloc(sizeof(*s), GFP_KERNEL);
+  if (s == NULL)
+    return -ENOMEM;
+  strlcpy(s->func, func, sizeof(s->func));
+  s->nr_edges = nr;
+  s->probes = vzalloc(nr * sizeof(kamprobe));
+  s->probe_ptrs = vzalloc(nr * sizeof(kamprobe *));
+  s->edges = vzalloc(nr * sizeof(struct cg_edge));
+  s->stats = __alloc_percpu(nr * sizeof(struct cg_stat),
+                            __alignof__(struct cg_stat));
+  if (s->probes == NULL || s->probe_ptrs == NULL || s->edges == NULL ||
+      s->stats == NULL) {
+    rc = -ENOMEM;
+    goto fail;
+  }
+
+  // reuse probe_ptrs as temporary storage for the sites
+  sites = (u8 **)s->probe_ptrs;
+  if (find_call_sites((u8 *)addr, size, sites) != nr) {
+    rc = -EILSEQ;
+    goto fail;
+  }
+  for (i = 0; i < nr; i++) {
+    s->edges[i] = (struct cg_edge){.session = s,
+                                   .idx = i,
+                                   .callee = call_insn_target(sites[i])};
+    s->probes[i] = (kamprobe){.tag = i,
+                              .state = PROBE_NO_HANDLERS,
+                              .addr = sites[i],
+                              .addr_type = ADDR_OF_CALL,
+                             };
+    s->probes[i].callout = (kam_callout){.on_entry = cg_enter,
+                                         .on_return = cg_exit,
+                                         .data = (unsigned long)&s->edges[i]};
+    s->probe_ptrs[i] = &s->probes[i];
+  }
+
+  mutex_lock(&cg_lock);
+  if (cg_current != NULL)
+    kamprobes_unregister_batch(cg_current->probe_ptrs,
+                               cg_current->nr_edges);
+  list_add(&s->list, &cg_sessions);
+  cg_current = s;
+  // sites probed already by someone else are rejected as duplicates
+  s->nr_probed = kamprobes_register_batch(s->probe_ptrs, nr);
+  mutex_unlock(&cg_lock);
+
+  printk(KERN_NOTICE "kamprobes: profiling %u of %u call sites in %s\n",
+         s->nr_probed, s->nr_edges, func);
+  return 0;
+
+fail:
+  free_session(s);
+  return rc;
+}
+EXPORT_SYMBOL(kam_callgraph_start);
+
+void kam_callgraph_stop(void)
+{
+  mutex_lock(&cg_lock);
+  if (cg_current != NULL)
+    kamprobes_unregister_batch(cg_current->probe_ptrs,
+                               cg_current->nr_edges);
+  mutex_unlock(&cg_lock);
+}
+EXPORT_SYMBOL(kam_callgraph_stop);
+
+static int callgraph_show(struct seq_file *m, void *v)
+{
+  struct cg_session *s;
+  struct cg_stat *stat;
+  u64 calls, cycles;
+  unsigned int i;
+  int cpu;
+
+  mutex_lock(&cg_lock);
+  s = cg_current;
+  if (s == NULL)
+    goto out;
+
+  seq_printf(m, "function %s sites %u probed %u\n", s->func, s->nr_edges,
+             s->nr_probed);
+  seq_puts(m, "cpu site callee calls cycles\n");
+  for (i = 0; i < s->nr_edges; i++) {
+    calls = cycles = 0;
+    for_each_possible_cpu(cpu) {
+      stat = &per_cpu_ptr(s->stats, cpu)[i];
+      if (stat->calls == 0)
+        continue;
+      seq_printf(m, "%d %pS %pS %llu %llu\n", cpu, s->probes[i].addr,
+                 s->edges[i].callee, stat->calls, stat->cycles);
+      calls += stat->calls;
+      cycles += stat->cycles;
+    }
+    if (calls > 0)
+      seq_printf(m, "all %pS %pS %llu %llu\n", s->probes[i].addr,
+                 s->edges[i].callee, calls, cycles);
+  }
+out:
+  mutex_unlock(&cg_lock);
+  return 0;
+}
+
+static int callgraph_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, callgraph_show, NULL);
+}
+
+static ssize_t callgraph_write(struct file *file, const char __user *ubuf,
+                               size_t count, loff_t *ppos)
+{
+  char func[KSYM_NAME_LEN];
+  size_t len = min(count, sizeof(func) - 1);
+  int rc;
+
+  if (copy_from_user(func, ubuf, len))
+    return -EFAULT;
+  func[len] = '\0';
+  strim(func);
+
+  if (strcmp(func, "stop") == 0) {
+    kam_callgraph_stop();
+    return count;
+  }
+  rc = kam_callgraph_start(func);
+  return rc ? rc : count;
+}
+
+static const struct file_operations callgraph_fops = {
+  .owner   = THIS_MODULE,
+  .open    = callgraph_open,
+  .read    = seq_read,
+  .write   = callgraph_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+int kam_callgraph_init(void)
+{
+  struct dentry *dir = kam_stats_debugfs_dir();
+
+  if (dir == NULL)
+    return -ENODEV;
+  debugfs_create_file("callgraph", 0644, dir, NULL, &callgraph_fops);
+  return 0;
+}
+
+/*
+ * Called by kamprobes_free, once the sites are restored and no task can be
+ * running inside the wrappers anymore.
+ */
+void kam_callgraph_free(void)
+{
+  struct cg_session *s, *tmp;
+
+  mutex_lock(&cg_lock);
+  cg_current = NULL;
+  list_for_each_entry_safe(s, tmp, &cg_sessions, list) {
+    list_del(&s->list);
+    free_session(s);
+  }
+  mutex_unlock(&cg_lock);
+}
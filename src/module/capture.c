@@ -0,0 +1,338 @@
+/**** Notice
+ * capture.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* Wrapper generation for capture probes (see kam/capture.h)
+ *
+ * A record is written by the following sequence, using only %r10 and %r11
+ * (caller-saved and not used for passing arguments, so dead both at a call
+ * site and at the __fentry__ call of a function):
+ *
+ *   [incl %gs:__preempt_count]        ; CONFIG_PREEMPT only
+ *   mov  $1, %r11d
+ *   xadd %r11d, %gs:kam_records.head  ; reserve a slot
+ *   and  $(KAM_RECORD_BUF_SZ - 1), %r11d
+ *   shl  $KAM_RECORD_SHIFT, %r11
+ *   add  %gs:kam_records.recs, %r11   ; %r11 = &recs[slot]
+ *   movl $tag, 0(%r11)
+ *   movl $info, 4(%r11)
+ *   mov  %arg, 8(%r11)                ; or, for dereferenced values:
+ *                                     ;   xor  %r10d, %r10d
+ *                                     ;   test %arg, %arg
+ *                                     ;   jz   1f    ; NULL is recorded as 0
+ *                                     ;   mov  off(%arg), %r10
+ *                                     ; 1:mov  %r10, 8(%r11)
+ *   ...
+ *   [decl %gs:__preempt_count]        ; CONFIG_PREEMPT only, this is what
+ *   [jnz 1f; call ___preempt_schedule ; preempt_enable() compiles to
+ *   1:]
+ *
+ * For call-site probes capturing the return value, the return address on the
+ * stack is replaced with the bottom half of the wrapper, which writes a return
+ * record and then jumps back to the instruction after the original call.
+ */
+#include "kam/capture.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "kam/asm2bin.h"
+#include "kam/constants.h"
+#include "kam/probes.h"
+#include "kam/stats.h"
+
+DEFINE_PER_CPU(struct kam_record_cpu, kam_records);
+EXPORT_PER_CPU_SYMBOL(kam_records);
+
+// x86 encodings of the argument registers, in ABI order
+static const u8 arg_regs[KAM_CAPTURE_MAX_ARGS] = {7, 6, 2, 1, 8, 9};
+#define REG_RAX 0
+#define REG_R10 10
+
+int kam_capture_init(void)
+{
+  int cpu;
+  struct kam_record_cpu *rc;
+
+  BUILD_BUG_ON(sizeof(struct kam_record) != 1 << KAM_RECORD_SHIFT);
+  BUILD_BUG_ON(KAM_RECORD_BUF_SZ & (KAM_RECORD_BUF_SZ - 1));
+
+  for_each_possible_cpu(cpu) {
+    rc = per_cpu_ptr(&kam_records, cpu);
+    rc->head = 0;
+    rc->recs = vzalloc_node(KAM_RECORD_BUF_SZ * sizeof(struct kam_record),
+                            cpu_to_node(cpu));
+    if (rc->recs == NULL) {
+      kam_capture_free();
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+void kam_capture_free(void)
+{
+  int cpu;
+  struct kam_record_cpu *rc;
+
+  for_each_possible_cpu(cpu) {
+    rc = per_cpu_ptr(&kam_records, cpu);
+    vfree(rc->recs);
+    rc->recs = NULL;
+  }
+}
+
+int kam_capture_read(int cpu, u32 *pos, kam_record *out, int max)
+{
+  struct kam_record_cpu *rc = per_cpu_ptr(&kam_records, cpu);
+  u32 head = READ_ONCE(rc->head);
+  int nr = 0;
+
+  if (head - *pos > KAM_RECORD_BUF_SZ)
+    *pos = head - KAM_RECORD_BUF_SZ;
+
+  smp_rmb();
+  while (*pos != head && nr < max) {
+    out[nr++] = rc->recs[*pos & (KAM_RECORD_BUF_SZ - 1)];
+    (*pos)++;
+  }
+  return nr;
+}
+EXPORT_SYMBOL(kam_capture_read);
+
+/*
+ * <debugfs>/kamprobes/capture: one line per record, consumed by the read.
+ * Positions are shared by all readers, so concurrent readers split the
+ * records between them. Each cpu is visited once per read() call, for at
+ * most KAM_RECORD_BUF_SZ records, so that a busy cpu cannot keep a reader
+ * there forever.
+ */
+#define CAPTURE_READ_BATCH 16
+// "cpu tag return" and KAM_CAPTURE_MAX_VALS " 0x..." values
+#define CAPTURE_LINE_MAX 192
+
+static DEFINE_MUTEX(capture_read_lock);
+static DEFINE_PER_CPU(u32, capture_pos);
+
+struct capture_reader {
+  size_t len;             // bytes of text in buf
+  size_t off;             // bytes of buf already copied out
+  kam_record recs[CAPTURE_READ_BATCH];
+  char buf[CAPTURE_READ_BATCH * CAPTURE_LINE_MAX];
+};
+
+static size_t format_records(char *buf, size_t size, int cpu,
+                             const kam_record *recs, int nr)
+{
+  size_t len = 0;
+  int i, j, nr_vals;
+
+  for (i = 0; i < nr; i++) {
+    nr_vals = min_t(int, KAM_REC_NR_VALS(recs[i].info), KAM_CAPTURE_MAX_VALS);
+    len += scnprintf(buf + len, size - len, "%d %u %s", cpu, recs[i].tag,
+                     KAM_REC_KIND(recs[i].info) == KAM_REC_RETURN ?
+                     "return" : "entry");
+    for (j = 0; j < nr_vals; j++)
+      len += scnprintf(buf + len, size - len, " %#llx", recs[i].vals[j]);
+    len += scnprintf(buf + len, size - len, "\n");
+  }
+  return len;
+}
+
+static int capture_open(struct inode *inode, struct file *file)
+{
+  struct capture_reader *r;
+
+  r = kzalloc(sizeof(*r), GFP_KERNEL);
+  if (r == NULL)
+    return -ENOMEM;
+  file->private_data = r;
+  return nonseekable_open(inode, file);
+}
+
+static ssize_t capture_read(struct file *file, char __user *ubuf,
+                            size_t count, loff_t *ppos)
+{
+  struct capture_reader *r = file->private_data;
+  size_t copied = 0, len;
+  int cpu = -1, nr, nr_cpu = 0;
+
+  mutex_lock(&capture_read_lock);
+  while (copied < count) {
+    if (r->off == r->len) {
+      r->off = r->len = 0;
+      for (;;) {
+        if (cpu < 0 || nr_cpu >= KAM_RECORD_BUF_SZ) {
+          cpu = cpumask_next(cpu, cpu_possible_mask);
+          nr_cpu = 0;
+          if (cpu >= nr_cpu_ids)
+            goto out;
+        }
+        nr = kam_capture_read(cpu, per_cpu_ptr(&capture_pos, cpu), r->recs,
+                              CAPTURE_READ_BATCH);
+        if (nr > 0)
+          break;
+        nr_cpu = KAM_RECORD_BUF_SZ;
+      }
+      nr_cpu += nr;
+      r->len = format_records(r->buf, sizeof(r->buf), cpu, r->recs, nr);
+    }
+    len = min(count - copied, r->len - r->off);
+    if (copy_to_user(ubuf + copied, r->buf + r->off, len)) {
+      mutex_unlock(&capture_read_lock);
+      return -EFAULT;
+    }
+    r->off += len;
+    copied += len;
+  }
+out:
+  mutex_unlock(&capture_read_lock);
+  *ppos += copied;
+  return copied;
+}
+
+static int capture_release(struct inode *inode, struct file *file)
+{
+  kfree(file->private_data);
+  return 0;
+}
+
+static const struct file_operations capture_fops = {
+  .owner   = THIS_MODULE,
+  .open    = capture_open,
+  .read    = capture_read,
+  .llseek  = no_llseek,
+  .release = capture_release,
+};
+
+int kam_capture_debugfs_init(void)
+{
+  struct dentry *dir = kam_stats_debugfs_dir();
+  int cpu;
+
+  if (dir == NULL)
+    return -ENODEV;
+  for_each_possible_cpu(cpu)
+    *per_cpu_ptr(&capture_pos, cpu) = 0;
+  debugfs_create_file("capture", 0400, dir, NULL, &capture_fops);
+  return 0;
+}
+
+int kam_capture_check(kamprobe *probe, u8 *addr)
+{
+  kam_capture *cap = probe->capture;
+  int i;
+
+  if (cap->nr_vals > KAM_CAPTURE_MAX_VALS)
+    return -EINVAL;
+  for (i = 0; i < cap->nr_vals; i++) {
+    if (cap->vals[i].arg >= KAM_CAPTURE_MAX_ARGS)
+      return -EINVAL;
+  }
+  // on callee probes, the return address would need to be saved in the
+  // wrapper itself, which is not reentrant
+  if (cap->ret && !is_call_insn(addr))
+    return -EINVAL;
+  return 0;
+}
+
+static void emit_record(char **wrapper_end, uint32_t tag, uint32_t info,
+                        kam_capture *cap)
+{
+  char *head = (char __force *)&kam_records.head;
+  char *recs = (char __force *)&kam_records.recs;
+  char disp;
+  int i;
+
+#ifdef CONFIG_PREEMPT
+  emit_inc_gs(wrapper_end, (char __force *)&__preempt_count);
+#endif
+  emit_mov_int_r11d(wrapper_end, 1);
+  emit_xadd_r11d_gs(wrapper_end, head);
+  emit_and_int_r11d(wrapper_end, KAM_RECORD_BUF_SZ - 1);
+  emit_shl_r11(wrapper_end, KAM_RECORD_SHIFT);
+  emit_add_gs_r11(wrapper_end, recs);
+
+  emit_mov_int_r11(wrapper_end, tag, offsetof(struct kam_record, tag));
+  emit_mov_int_r11(wrapper_end, info, offsetof(struct kam_record, info));
+
+  if (cap == NULL) {
+    // return record
+    emit_mov_reg_r11(wrapper_end, REG_RAX, offsetof(struct kam_record, vals));
+  } else {
+    for (i = 0; i < cap->nr_vals; i++) {
+      disp = offsetof(struct kam_record, vals) + i * sizeof(u64);
+      if (cap->vals[i].deref) {
+        emit_mov_deref_r10(wrapper_end, arg_regs[cap->vals[i].arg],
+                           cap->vals[i].offset);
+        emit_mov_reg_r11(wrapper_end, REG_R10, disp);
+      } else {
+        emit_mov_reg_r11(wrapper_end, arg_regs[cap->vals[i].arg], disp);
+      }
+    }
+  }
+
+#ifdef CONFIG_PREEMPT
+  emit_dec_gs(wrapper_end, (char __force *)&__preempt_count);
+  // decl already set ZF, no condition to test
+  emit_short_cond_jmp(wrapper_end, NULL, 0, CALL_WIDTH);
+  emit_callq(wrapper_end, (char *)___preempt_schedule);
+#endif
+}
+
+/*
+ * Write the wrapper of a capture probe at *wrapper_end and return its start.
+ * in_flight is the counter already reserved for the wrapper (NULL if it has
+ * no return path).
+ */
+char *kam_emit_capture_wrapper(char **wrapper_end, kamprobe *probe, u8 *addr,
+                               atomic_t *in_flight)
+{
+  kam_capture *cap = probe->capture;
+  char *wrapper_fp = *wrapper_end;
+  char *target;
+  char *bottom;
+
+  emit_record(wrapper_end, probe->tag,
+              KAM_REC_INFO(KAM_REC_ENTRY, cap->nr_vals), cap);
+
+  if (!is_call_insn(addr)) {
+    // callee probe: continue after the __fentry__ call
+    emit_jump(wrapper_end, (char *)(addr + CALL_WIDTH));
+    return wrapper_fp;
+  }
+
+  target = (char *)call_insn_target(addr);
+  if ((probe->addr_type & ADDR_TYPE_MASK) == ADDR_KERNEL_SYSCALL)
+    target += CALL_WIDTH;
+
+  if (cap->ret) {
+    emit_lock_inc_rip(wrapper_end, (char *)in_flight);
+    // return into the bottom half, just after the jump to target
+    bottom = *wrapper_end + MOV_WIDTH + JMP_WIDTH;
+    emit_mov_addr_rsp(wrapper_end, bottom, 0);
+  }
+
+  // the patched call already pushed the original return address (or, if
+  // capturing the return value, its replacement)
+  emit_jump(wrapper_end, target);
+
+  if (cap->ret) {
+    emit_record(wrapper_end, probe->tag, KAM_REC_INFO(KAM_REC_RETURN, 1),
+                NULL);
+    emit_lock_dec_rip(wrapper_end, (char *)in_flight);
+    emit_jump(wrapper_end, (char *)(addr + CALL_WIDTH));
+  }
+  return wrapper_fp;
+}
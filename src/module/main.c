@@ -0,0 +1,56 @@
+/**** Notice
+ * main.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* kamprobes.ko
+ *
+ * Loading the module resolves the private kernel symbols kamprobes needs and
+ * calls kamprobes_init, so /dev/kam_bpf, /dev/kam_acct and the debugfs files
+ * are there without any other module. Modules setting their own probes are
+ * built against its Module.symvers (KBUILD_EXTRA_SYMBOLS, see the kambench
+ * target in CMakeLists.txt); their kamprobes_init calls find everything set
+ * up already. They must unregister their probes before being unloaded.
+ * Unloading kamprobes.ko calls kamprobes_free.
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "kam/config.h"
+#include "kam/probes.h"
+#define _PRIV_KALLSYMS_IMPL_
+#include "kam/kallsyms_config.h"
+
+static int max_probes = 4096;
+module_param(max_probes, int, 0444);
+MODULE_PARM_DESC(max_probes, "number of probe wrappers reserved at load time");
+
+static int __init kamprobes_mod_init(void)
+{
+  int rc;
+
+  rc = init_priv_kallsyms();
+  if (rc) {
+    printk(KERN_ERR "kamprobes: cannot find required kernel kallsyms\n");
+    return rc;
+  }
+  return kamprobes_init(max_probes);
+}
+
+static void __exit kamprobes_mod_cleanup(void)
+{
+  kamprobes_free();
+}
+
+module_init(kamprobes_mod_init);
+module_exit(kamprobes_mod_cleanup);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Lucian Carata <lucian.carata@cl.cam.ac.uk>");
+MODULE_VERSION(KAMPROBES_KVERSION);
+MODULE_DESCRIPTION(KAMPROBES_DESC);
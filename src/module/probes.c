@@ -17,18 +17,44 @@
  * call wrappers into a buffer, then modify the existing kernel code to
  * jump into the pre-handler instead of the original function.
  *
- * The code below is not thread-safe, so if you need to call the functions here
- * from multiple threads, first acquire the kamprobes_lock mutex.
+ * Single registrations patch their site with text_poke_bp(), which leaves the
+ * other cpus running; batches patch all their sites in one stop_machine()
+ * pass, whose cost does not grow with the number of sites.
+ *
+ * Teardown restores all the patched sites in a single stop_machine() pass and
+ * then waits for the wrappers to become quiescent before releasing the wrapper
+ * memory: no task may be running wrapper code and no task may be blocked inside
+ * a probed function that will later return through a wrapper (tracked by the
+ * in_flight counters of wrappers with a return path).
+ *
+ * Everything teardown relies on is kept in struct kam_wrapper records, one per
+ * generated wrapper, and not in the caller's kamprobe: a kamprobe can go away
+ * as soon as it is unregistered.
+ *
+ * Registration, unregistration, init and teardown are serialized by
+ * kamprobes_lock, taken inside the exported functions below. Components that
+ * register probes (callgraph.c, bpf.c) take their own lock first, and must not
+ * be called back into with kamprobes_lock held.
  */
 #include "kam/probes.h"
 
 #include <linux/cpu.h>
+#include <linux/delay.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/stop_machine.h>
 #include <linux/vmalloc.h>
 #include <linux/mutex.h>
 
 #include "kam/constants.h"
+#include "kam/acct.h"
 #include "kam/asm2bin.h"
+#include "kam/bpf.h"
+#include "kam/callgraph.h"
 #include "kam/kallsyms_config.h"
+#include "kam/stats.h"
+#include "kam/trace.h"
 #include "ldry/macros/unused.h"
 #include "ldry/kernel/macros/debug.h"
 
@@ -41,24 +67,108 @@
 
 static unsigned int no_active_probes = 0;
 
+// all the wrappers generated since kamprobes_init, in registration order;
+// wrappers are never reused, so records stay here until kamprobes_free
+static struct kam_wrapper *wrappers = NULL;
+static unsigned int no_probes = 0;
+static unsigned int max_no_probes = 0;
+// active probes, by patched site
+#define SITE_HASH_BITS 14
+static DEFINE_HASHTABLE(active_sites, SITE_HASH_BITS);
+
 static char *wrapper_start = NULL;
 static char *wrapper_end;
-static struct mutex UNUSED(kamprobes_lock);
-static void mark_probe_active(kamprobe *probe);
+static size_t wrapper_arena_sz = 0;
+static DEFINE_MUTEX(kamprobes_lock);
+static void mark_probe_active(struct kam_wrapper *w, kamprobe *probe,
+                              u8 *addr);
+static unsigned int patch_sites(unsigned int first, int restore);
+static unsigned int restore_sites(void);
 
 int kamprobes_init(int max_probes)
 {
+  mutex_lock(&kamprobes_lock);
   if (wrapper_start == NULL) {
-    wrapper_start = KPRIV(module_alloc)(WRAPPER_SIZE * max_probes);
+    wrappers = vzalloc(max_probes * sizeof(*wrappers));
+    if (wrappers == NULL) {
+      mutex_unlock(&kamprobes_lock);
+      return -ENOMEM;
+    }
+
+    wrapper_arena_sz = WRAPPER_SLOT_SIZE * max_probes;
+    wrapper_start = KPRIV(module_alloc)(wrapper_arena_sz);
+    if (wrapper_start == NULL) {
+      vfree(wrappers);
+      wrappers = NULL;
+      mutex_unlock(&kamprobes_lock);
+      return -ENOMEM;
+    }
+
+    if (kam_capture_init() != 0) {
+      vfree(wrapper_start);
+      wrapper_start = NULL;
+      vfree(wrappers);
+      wrappers = NULL;
+      mutex_unlock(&kamprobes_lock);
+      return -ENOMEM;
+    }
 
     wrapper_end = wrapper_start;
+    max_no_probes = max_probes;
+    no_probes = 0;
+    hash_init(active_sites);
+
+    // not having the counters is no reason to refuse setting probes
+    if (kam_stats_init() != 0 || kam_callgraph_init() != 0 ||
+        kam_capture_debugfs_init() != 0)
+      debugk("kamprobes: debugfs interface unavailable\n");
+    if (kam_acct_init() != 0)
+      debugk("kamprobes: /dev/%s unavailable\n", KAM_ACCT_DEVICE);
+    if (kam_bpf_init() != 0)
+      debugk("kamprobes: /dev/%s unavailable\n", KAM_BPF_DEVICE);
+    if (kam_trace_init() != 0)
+      debugk("kamprobes: trace buffers unavailable\n");
+    kam_stats_arena(0, wrapper_arena_sz);
 
     debugk("wrapper_start:%p\n", wrapper_start);
   }
+  mutex_unlock(&kamprobes_lock);
   return 0;
 }
 EXPORT_SYMBOL(kamprobes_init);
 
+unsigned int kamprobes_count(void)
+{
+  return no_probes;
+}
+
+const struct kam_wrapper *kamprobes_get(unsigned int i)
+{
+  return i < no_probes ? &wrappers[i] : NULL;
+}
+
+static struct kam_wrapper *find_active_site(u8 *addr)
+{
+  struct kam_wrapper *w;
+
+  hash_for_each_possible(active_sites, w, site_node, (unsigned long)addr) {
+    if (w->site == addr)
+      return w;
+  }
+  return NULL;
+}
+
+// the record of probe, if it is registered
+static struct kam_wrapper *find_registered(kamprobe *probe)
+{
+  struct kam_wrapper *w;
+
+  if (probe->state != PROBE_ACTIVE)
+    return NULL;
+  w = find_active_site(probe->site);
+  return w != NULL && w->probe == probe ? w : NULL;
+}
+
 u8* resolve_module_addr(module_addr m_addr) {
  //TODO(lc525) build module cache?
  //investigate find_module_sections
@@ -82,7 +192,71 @@ u8* resolve_module_addr(module_addr m_addr) {
  }
 }
 
-int kamprobe_register(kamprobe* probe)
+static inline int can_be_direct(kamprobe *probe, u8 *addr)
+{
+  int type = probe->addr_type & ADDR_TYPE_MASK;
+
+  return is_call_insn(addr) && probe->on_return == NULL &&
+         probe->capture == NULL &&
+         (type == ADDR_OF_CALL || type == ADDR_KERNEL_SYSCALL);
+}
+
+static inline int is_callout(kamprobe *probe)
+{
+  return probe->callout.on_entry != NULL || probe->callout.on_return != NULL;
+}
+
+static inline int can_callout(kamprobe *probe, u8 *addr)
+{
+  if (probe->capture != NULL || probe->on_entry != NULL ||
+      probe->on_return != NULL || (probe->flags & PROBE_DIRECT))
+    return 0;
+  // as for capture probes, the return address must be known statically
+  return probe->callout.on_return == NULL || is_call_insn(addr);
+}
+
+static inline int has_return_path(kamprobe *probe)
+{
+  if (probe->capture != NULL)
+    return probe->capture->ret;
+  if (is_callout(probe))
+    return probe->callout.on_return != NULL;
+  return probe->on_return != NULL;
+}
+
+static inline size_t wrapper_size_bound(kamprobe *probe)
+{
+  if (probe->capture != NULL)
+    return CAPTURE_WRAPPER_SIZE;
+  if (is_callout(probe))
+    return CALLOUT_WRAPPER_SIZE;
+  return WRAPPER_SIZE;
+}
+
+/*
+ * Save the argument registers as a struct kam_regs on the stack, call
+ * fn(regs, data) and restore them. pad keeps the stack 16 byte aligned at the
+ * call: it must be set when *(rsp) was already popped (return path).
+ */
+static void emit_callout(char **wrapper_end, kam_callout_fn fn,
+                         unsigned long data, int pad)
+{
+  if (pad)
+    emit_sub_rsp(wrapper_end, WORD_SZ);
+  emit_save_args(wrapper_end);
+  emit_mov_rsp_rdi(wrapper_end);
+  emit_movabs_rsi(wrapper_end, data);
+  emit_callq(wrapper_end, (char *)fn);
+  emit_restore_args(wrapper_end);
+  if (pad)
+    emit_add_rsp(wrapper_end, WORD_SZ);
+}
+
+/*
+ * Generate the wrapper for probe and mark it active, without patching the
+ * probed site. On failure, the probe is left untouched.
+ */
+static int prepare_probe(kamprobe *probe)
 {
   // There are two types of probes covered by the wrapper:
   // 1. call-site probes, placed on a callq instruction:
@@ -94,22 +268,35 @@ int kamprobe_register(kamprobe* probe)
   //    for these, we need __fentry__ support and on execution of the original
   //    function will change the return address so that the function returns
   //    into the bottom part of our wrapper (for the return handler)
+  struct kam_wrapper *w;
   char *wrapper_fp;
   int offset;
   char *target;
-  int32_t addr_ptr;
-  unsigned char text_poke_isns[CALL_WIDTH];
+  char *bottom;
   u8 *addr;
-  int i;
+  int i, rc;
 
-  const char callq_opcode = 0xe8;
-  const char jmpq_opcode = 0xe9;
   // test rax, rax
   const char jmpnz_cond[3] = {0x48, 0x85, 0xC0};
 
-  switch (probe->addr_type & ADDR_LOC_MASK) {
+  if (find_registered(probe) != NULL) {
+    kam_stats_reject(REJECT_DUPLICATE);
+    return -EBUSY;
+  }
+
+  if (no_probes == max_no_probes) {
+    kam_stats_reject(REJECT_NO_SPACE);
+    return -ENOSPC;
+  }
+  w = &wrappers[no_probes];
+
+  switch (ADDR_LOC(probe->addr_type)) {
     case ADDR_MODULE:
       addr = resolve_module_addr(probe->m_addr);
+      if (addr == NULL) {
+        kam_stats_reject(REJECT_MODULE_MISSING);
+        return -ENOENT;
+      }
       break;
     case ADDR_KERNEL:
     default:
@@ -118,11 +305,124 @@ int kamprobe_register(kamprobe* probe)
 
   // Refuse to register probes on any addr which is not a callq or a noop
   if((!is_call_insn(addr) && !is_noop(addr))) {
-    printk(KERN_ERR "Failed to set probe at %p\n", (void *)addr);
+    kam_stats_reject(REJECT_NOT_CALL_NOP);
+    return -EINVAL;
+  }
+
+  // A site already patched now calls into a wrapper; taking it over would
+  // record the wrapper as the original target.
+  if (find_active_site(addr) != NULL) {
+    kam_stats_reject(REJECT_DUPLICATE);
+    return -EEXIST;
+  }
+
+  if (probe->capture != NULL) {
+    rc = kam_capture_check(probe, addr);
+    if (rc) {
+      kam_stats_reject(REJECT_INVALID_SPEC);
+      return rc;
+    }
+  }
+
+  if ((probe->flags & PROBE_DIRECT) && !can_be_direct(probe, addr)) {
+    kam_stats_reject(REJECT_INVALID_SPEC);
+    return -EINVAL;
+  }
+
+  if (is_callout(probe) && !can_callout(probe, addr)) {
+    kam_stats_reject(REJECT_INVALID_SPEC);
     return -EINVAL;
   }
 
-  printk(KERN_ERR "wrapper_start:%p\n", wrapper_end);
+  // Tasks that enter a wrapper with a return path will later come back into
+  // its bottom half; count them so that the wrapper memory is not released
+  // under their feet (see kamprobes_free). The counter is updated with locked
+  // instructions on every hit, so it must not straddle a cache line.
+  wrapper_fp = wrapper_end;
+  if (has_return_path(probe))
+    wrapper_fp = PTR_ALIGN(wrapper_end, WORD_SZ) + WORD_SZ;
+
+  if (wrapper_fp + RESUME_STUB_SIZE + wrapper_size_bound(probe) >
+      wrapper_start + wrapper_arena_sz) {
+    kam_stats_reject(REJECT_NO_SPACE);
+    return -ENOSPC;
+  }
+
+  w->in_flight = NULL;
+  if (has_return_path(probe)) {
+    w->in_flight = (atomic_t *)(wrapper_fp - WORD_SZ);
+    atomic_set(w->in_flight, 0);
+    wrapper_end = wrapper_fp;
+  }
+
+  // Cpus hitting the site while poke_site() rewrites it continue at
+  // w->resume, which must do what the original instruction does: a call
+  // is replayed by a stub that returns straight to the caller, a nop is
+  // skipped.
+  if (is_call_insn(addr)) {
+    w->resume = (u8 *)wrapper_end;
+    emit_push_addr(&wrapper_end, (char *)(addr + CALL_WIDTH));
+    emit_jump(&wrapper_end, (char *)call_insn_target(addr));
+  } else {
+    w->resume = addr + CALL_WIDTH;
+  }
+
+  // Capture probes get a wrapper that records values and does not call any
+  // handlers (see capture.c)
+  if (probe->capture != NULL) {
+    wrapper_fp = kam_emit_capture_wrapper(&wrapper_end, probe, addr,
+                                          w->in_flight);
+    goto wrapper_done;
+  }
+
+  // Entry-only call-site probes: no return path can exist, so there is no
+  // need to rewrite return addresses or to test the pre-handler result.
+  // The pre-handler is called normally, which keeps the return stack buffer
+  // of the cpu in sync (the jmp/ret pairs of the full wrapper do not), and
+  // then we tail-jump into the original target. The patched call already
+  // pushed the original return address.
+  if (probe->flags & PROBE_DIRECT) {
+    wrapper_fp = wrapper_end;
+    // keep the tag at the same place relative to the pre-handler frame as in
+    // the full wrapper, the call below pushes one more word
+    emit_mov_int_rsp(&wrapper_end, probe->tag, neg_c2(9 * WORD_SZ));
+    emit_callq(&wrapper_end, (char *)probe->on_entry);
+    target = (char *)call_insn_target(addr);
+    if ((probe->addr_type & ADDR_TYPE_MASK) == ADDR_KERNEL_SYSCALL)
+      target += CALL_WIDTH;
+    emit_jump(&wrapper_end, target);
+    goto wrapper_done;
+  }
+
+  // Callout probes: the handlers are plain C functions, called with the saved
+  // argument registers (see kam_callout)
+  if (is_callout(probe)) {
+    wrapper_fp = wrapper_end;
+    if (probe->callout.on_entry != NULL)
+      emit_callout(&wrapper_end, probe->callout.on_entry, probe->callout.data,
+                   0);
+    if (!is_call_insn(addr)) {
+      emit_jump(&wrapper_end, (char *)(addr + CALL_WIDTH));
+      goto wrapper_done;
+    }
+    target = (char *)call_insn_target(addr);
+    if ((probe->addr_type & ADDR_TYPE_MASK) == ADDR_KERNEL_SYSCALL)
+      target += CALL_WIDTH;
+    if (probe->callout.on_return != NULL) {
+      emit_lock_inc_rip(&wrapper_end, (char *)w->in_flight);
+      bottom = wrapper_end + MOV_WIDTH + JMP_WIDTH;
+      emit_mov_addr_rsp(&wrapper_end, bottom, 0);
+    }
+    emit_jump(&wrapper_end, target);
+    if (probe->callout.on_return != NULL) {
+      emit_callout(&wrapper_end, probe->callout.on_return, probe->callout.data,
+                   1);
+      emit_lock_dec_rip(&wrapper_end, (char *)w->in_flight);
+      emit_jump(&wrapper_end, (char *)(addr + CALL_WIDTH));
+    }
+    goto wrapper_done;
+  }
+
   // If *addr is not a call instruction then we assume it is the start
   // of a sys_ function, called though other means. We don't want to rewrite
   // this code, so instead make use of the __fentry__ call placed at the
@@ -162,7 +462,7 @@ int kamprobe_register(kamprobe* probe)
   }
   // replace old return address with address just after the jmp into the
   // pre-handler
-  emit_mov_addr_rsp(&wrapper_end, wrapper_end + JMP_WIDTH, 0);
+  emit_mov_addr_rsp(&wrapper_end, wrapper_end + MOV_WIDTH + JMP_WIDTH, 0);
 
   // Find the target of the callq in the original instruction stream.
   // We need this so that after calling the pre handler we can then call
@@ -192,8 +492,12 @@ int kamprobe_register(kamprobe* probe)
   // return address to point to the wrapper (the next call to emit_mov_addr_rsp)
   if(probe->on_return != NULL) {
     // test rax, rax
-    // jnz MOV_WIDTH [over emit_mov_addr_rsp]
-    emit_short_cond_jmp(&wrapper_end, jmpnz_cond, sizeof(jmpnz_cond), MOV_WIDTH);
+    // jnz INC_WIDTH + MOV_WIDTH [over emit_lock_inc_rip, emit_mov_addr_rsp]
+    emit_short_cond_jmp(&wrapper_end, jmpnz_cond, sizeof(jmpnz_cond),
+                        INC_WIDTH + MOV_WIDTH);
+
+    // The task will return through the bottom half of the wrapper
+    emit_lock_inc_rip(&wrapper_end, (char *)w->in_flight);
 
     // Change the top of the stack so it points at the bottom-half of the wrapper,
     // which is the bit that does the calling of the rtn-handler.
@@ -220,6 +524,11 @@ int kamprobe_register(kamprobe* probe)
     }
 
     if(probe->on_return != NULL) {
+      // The task is leaving the wrapper for good. Only the push and the jmp
+      // below still execute from wrapper memory; those are covered by the
+      // quiescent period of kamprobes_free.
+      emit_lock_dec_rip(&wrapper_end, (char *)w->in_flight);
+
       // Set up the return address of the on_return handler.
       // This is set to be the next instruction in the original instruction
       // stream. This means that control flow goes directly back from the return
@@ -240,6 +549,8 @@ int kamprobe_register(kamprobe* probe)
     // need to restore it, from wrapper_fp - 8
 
     if(probe->on_return != NULL){
+      emit_lock_dec_rip(&wrapper_end, (char *)w->in_flight);
+
       // First, move the return address into a register that we can trash (r11).
       emit_return_address_to_r11(&wrapper_end, wrapper_fp);
 
@@ -257,70 +568,360 @@ int kamprobe_register(kamprobe* probe)
     emit_jump(&wrapper_end, (char *)probe->on_return);
   }
 
-  printk(KERN_ERR "wrapper_end:%p\n", wrapper_end);
   // End of setting up the wrapper. Now change the text section to point to it.
+wrapper_done:
+  w->code = wrapper_fp;
+  w->size = wrapper_end - wrapper_fp;
+  probe->probe_code = w->code;
+  probe->wrapper_sz = w->size;
+  no_probes++;
+  kam_stats_arena(wrapper_end - wrapper_start, wrapper_arena_sz);
+
+  // Store the original code so that we can remove kamprobes.
+  mark_probe_active(w, probe, addr);
+  return 0;
+}
+
+// The instruction that replaces the original one at the probed site
+static void make_patch_insn(struct kam_wrapper *w, unsigned char *insn)
+{
+  const char callq_opcode = 0xe8;
+  const char jmpq_opcode = 0xe9;
+  int32_t addr_ptr;
+
+  addr_ptr = (char *)w->code - CALL_WIDTH - (char *)w->site;
 
-  // Store the original address so that we can remove kamprobes.
-  mark_probe_active(probe);
   // Ensure we start with a callq opcode, in case of nop-ed insns.
+  if(is_call_insn(w->orig_code)) { // callq
+    insn[0] = callq_opcode;
+  } else {                             // SyS_ call
+    insn[0] = jmpq_opcode;
+  }
+  memcpy(insn + 1, &addr_ptr, CALL_WIDTH - 1);
+}
 
-  // Poke the original instruction to point to our wrapper.
-  addr_ptr = wrapper_fp - CALL_WIDTH - (char *)addr;
+static void mark_site_removed(struct kam_wrapper *w)
+{
+  w->state = PROBE_REMOVED;
+  hash_del(&w->site_node);
+  kam_stats_active(w->addr_type, -1);
+  // the last time kamprobes touches the caller's struct
+  w->probe->state = PROBE_REMOVED;
+  w->probe = NULL;
+}
 
-  if(is_call_insn(addr)) { // callq
-    text_poke_isns[0] = callq_opcode;
-  } else {                // SyS_ call
-    text_poke_isns[0] = jmpq_opcode;
+/*
+ * Patch (or restore) the site of a single record with text_poke_bp(): cpus
+ * executing the site meanwhile trap on a temporary int3 and continue at
+ * w->resume, so the other cpus are not stopped. The instruction is replaced
+ * as a whole before this returns.
+ */
+static void poke_site(struct kam_wrapper *w, int restore)
+{
+  unsigned char insn[CALL_WIDTH];
+  u64 t_start = ktime_get_ns();
+
+  if (!restore)
+    make_patch_insn(w, insn);
+  // same lock order as in patch_sites()
+  cpus_read_lock();
+  mutex_lock(KPRIV(text_mutex));
+  KPRIV(text_poke_bp)(w->site, restore ? w->orig_code : insn, CALL_WIDTH,
+                      w->resume);
+  mutex_unlock(KPRIV(text_mutex));
+  cpus_read_unlock();
+  w->pending = 0;
+  kam_stats_latency(LAT_POKE, ktime_get_ns() - t_start);
+}
+
+int kamprobe_register(kamprobe* probe)
+{
+  u64 t_start = ktime_get_ns();
+  int rc;
+
+  mutex_lock(&kamprobes_lock);
+  rc = prepare_probe(probe);
+  if (rc) {
+    mutex_unlock(&kamprobes_lock);
+    return rc;
   }
-  memcpy(text_poke_isns + 1, &addr_ptr, CALL_WIDTH - 1);
+  kam_stats_latency(LAT_REGISTER, ktime_get_ns() - t_start);
 
-  /*get_online_cpus();
-   *mutex_lock(KPRIV(text_mutex));
-   *KPRIV(text_poke)(addr, &text_poke_isns, CALL_WIDTH);
-   *mutex_unlock(KPRIV(text_mutex));
-   *put_online_cpus();*/
+  // Poke the original instruction to point to our wrapper.
+  poke_site(&wrappers[no_probes - 1], 0);
+  mutex_unlock(&kamprobes_lock);
   return 0;
 }
 EXPORT_SYMBOL(kamprobe_register);
 
 int kamprobe_unregister(kamprobe *probe){
-  if(probe->state == PROBE_ACTIVE) {
-    get_online_cpus();
-    mutex_lock(KPRIV(text_mutex));
-    KPRIV(text_poke)(probe->addr, probe->orig_code, CALL_WIDTH);
-    no_active_probes--;
-    probe->state = PROBE_REMOVED;
-    mutex_unlock(KPRIV(text_mutex));
-    put_online_cpus();
+  struct kam_wrapper *w;
+  int rc = 0;
+
+  mutex_lock(&kamprobes_lock);
+  w = find_registered(probe);
+  if (w == NULL) {
+    rc = -EEXIST;
   } else {
-    return -EEXIST;
+    poke_site(w, 1);
+    mark_site_removed(w);
+    no_active_probes--;
   }
-  return 0;
+  mutex_unlock(&kamprobes_lock);
+  return rc;
 }
+EXPORT_SYMBOL(kamprobe_unregister);
 
-void kamprobes_free() {
-  vfree(wrapper_start);
-}
-
-static void mark_probe_active(kamprobe *probe)
+static void mark_probe_active(struct kam_wrapper *w, kamprobe *probe,
+                              u8 *addr)
 {
   int i;
   for (i = 0; i < CALL_WIDTH; i++) {
-    probe->orig_code[i] = probe->addr[i];
+    w->orig_code[i] = addr[i];
   }
+  w->probe = probe;
+  w->tag = probe->tag;
+  w->addr_type = probe->addr_type;
+  w->site = addr;
+  w->state = PROBE_ACTIVE;
+  w->pending = 1;
+  hash_add(active_sites, &w->site_node, (unsigned long)addr);
+  probe->site = addr;
   probe->state = PROBE_ACTIVE;
+  kam_stats_active(probe->addr_type, 1);
   no_active_probes++;
 }
 
+struct patch_batch {
+  unsigned int first; // records [first, no_probes) with pending set
+  int restore;        // put back orig_code rather than the call to the wrapper
+  unsigned int done_nr;
+  atomic_t cpus_in;
+  int done;
+};
+
+/*
+ * Runs on every online cpu under stop_machine(). The first cpu to get here
+ * rewrites all the sites while the others spin with interrupts disabled, so no
+ * cpu can observe a half-written call instruction; everyone serializes its
+ * instruction stream before leaving.
+ */
+static int patch_sites_stopped(void *data)
+{
+  struct patch_batch *batch = data;
+  unsigned char insn[CALL_WIDTH];
+  struct kam_wrapper *w;
+  unsigned int i;
+
+  if (atomic_inc_return(&batch->cpus_in) == 1) {
+    for (i = batch->first; i < no_probes; i++) {
+      w = &wrappers[i];
+      if (!w->pending)
+        continue;
+      w->pending = 0;
+      if (w->state != PROBE_ACTIVE)
+        continue;
+      if (batch->restore) {
+        KPRIV(text_poke)(w->site, w->orig_code, CALL_WIDTH);
+        mark_site_removed(w);
+      } else {
+        make_patch_insn(w, insn);
+        KPRIV(text_poke)(w->site, insn, CALL_WIDTH);
+      }
+      batch->done_nr++;
+    }
+    smp_wmb();
+    WRITE_ONCE(batch->done, 1);
+  } else {
+    while (!READ_ONCE(batch->done))
+      cpu_relax();
+    smp_rmb();
+  }
+  sync_core();
+  return 0;
+}
+
+/*
+ * Patch (or, with restore set, put back the original code of) the sites of
+ * all the pending records from first on, in one patching pass. Once a restore
+ * returns, no cpu can enter those wrappers anymore and, on non-preemptible
+ * kernels, no task is still executing the entry half of any of them (every
+ * cpu went through the stopper thread).
+ */
+static unsigned int patch_sites(unsigned int first, int restore)
+{
+  struct patch_batch batch = {
+    .first = first,
+    .restore = restore,
+    .done_nr = 0,
+    .cpus_in = ATOMIC_INIT(0),
+    .done = 0
+  };
+  u64 t_start = ktime_get_ns();
+
+  // same lock order as text_poke_bp() users (kprobes, jump labels): the
+  // hotplug lock comes first, stop_machine() would take it after text_mutex
+  cpus_read_lock();
+  mutex_lock(KPRIV(text_mutex));
+  stop_machine_cpuslocked(patch_sites_stopped, &batch, cpu_online_mask);
+  mutex_unlock(KPRIV(text_mutex));
+  cpus_read_unlock();
+  kam_stats_latency(restore ? LAT_RESTORE : LAT_PATCH,
+                    ktime_get_ns() - t_start);
+  return batch.done_nr;
+}
+
+static unsigned int restore_sites(void)
+{
+  unsigned int restored = patch_sites(0, 1);
+
+  no_active_probes -= restored;
+  return restored;
+}
+
+/*
+ * Register all the probes in probes[0..nr), patching their sites in a single
+ * stop_machine() pass. Returns the number of probes registered; the ones that
+ * could not be registered are left in their original state (!= PROBE_ACTIVE)
+ */
+int kamprobes_register_batch(kamprobe **probes, unsigned int nr)
+{
+  unsigned int i, first, prepared = 0;
+  u64 t_start;
+
+  mutex_lock(&kamprobes_lock);
+  first = no_probes;
+  for (i = 0; i < nr; i++) {
+    t_start = ktime_get_ns();
+    if (prepare_probe(probes[i]) == 0) {
+      prepared++;
+      kam_stats_latency(LAT_REGISTER, ktime_get_ns() - t_start);
+    }
+  }
+  if (prepared > 0)
+    patch_sites(first, 0);
+  mutex_unlock(&kamprobes_lock);
+  return prepared;
+}
+EXPORT_SYMBOL(kamprobes_register_batch);
+
+int kamprobes_unregister_batch(kamprobe **probes, unsigned int nr)
+{
+  struct kam_wrapper *w;
+  unsigned int i;
+  int restored = 0;
+
+  mutex_lock(&kamprobes_lock);
+  for (i = 0; i < nr; i++) {
+    w = find_registered(probes[i]);
+    if (w != NULL) {
+      w->pending = 1;
+      restored++;
+    }
+  }
+  if (restored > 0)
+    restored = restore_sites();
+  mutex_unlock(&kamprobes_lock);
+  return restored;
+}
+EXPORT_SYMBOL(kamprobes_unregister_batch);
+
+static void unregister_all(void)
+{
+  unsigned int i, restored = 0;
+
+  if (no_active_probes > 0) {
+    for (i = 0; i < no_probes; i++)
+      wrappers[i].pending = 1;
+    restored = restore_sites();
+  }
+  debugk(KERN_NOTICE "Unregistered %u probes\n", restored);
+}
+
 void kamprobes_unregister_all(void)
 {
-  int i;
+  mutex_lock(&kamprobes_lock);
+  unregister_all();
+  mutex_unlock(&kamprobes_lock);
+}
+EXPORT_SYMBOL(kamprobes_unregister_all);
+
+/*
+ * Wait until every task has gone through a scheduling point. Preempted tasks
+ * do not count as quiescent on preemptible kernels, as they might have been
+ * stopped while executing wrapper code.
+ */
+static void wait_quiescent(void)
+{
+#ifdef CONFIG_TASKS_RCU
+  synchronize_rcu_tasks();
+#else
+  synchronize_sched();
+#endif
+}
+
+/*
+ * Wait for the tasks that entered a wrapper with a return handler but have not
+ * yet returned through it (typically tasks blocked inside the probed
+ * function). Sites are already restored, so the counters can only go down.
+ */
+static void drain_in_flight(void)
+{
+  unsigned int i, waited_ms = 0;
+  struct kam_wrapper *w;
+
+  for (i = 0; i < no_probes; i++) {
+    w = &wrappers[i];
+    if (w->in_flight == NULL)
+      continue;
+    while (atomic_read(w->in_flight) > 0) {
+      msleep(DRAIN_POLL_MS);
+      waited_ms += DRAIN_POLL_MS;
+      if (waited_ms % DRAIN_WARN_MS == 0)
+        printk(KERN_WARNING "kamprobes: probe %d still has %d tasks in "
+                            "flight, waiting\n",
+               w->tag, atomic_read(w->in_flight));
+    }
+  }
+}
 
-  get_online_cpus();
-  for (i = 0; i < no_active_probes; i++) {
-    /*KPRIV(text_poke)(probe_list[i].loc, &probe_list[i].vals, CALL_WIDTH);*/
+void kamprobes_free(void)
+{
+  mutex_lock(&kamprobes_lock);
+  if (wrapper_start == NULL) {
+    mutex_unlock(&kamprobes_lock);
+    return;
   }
-  debugk(KERN_NOTICE "Unregistered %d probes\n", no_active_probes);
-  no_active_probes = 0;
-  put_online_cpus();
+  unregister_all();
+  // refuse registrations from here on, see prepare_probe
+  max_no_probes = no_probes;
+  mutex_unlock(&kamprobes_lock);
+
+  kam_stats_free();
+
+  // Tasks preempted or interrupted inside the entry half of a wrapper might
+  // still bump an in_flight counter: stop_machine() does not wait for the
+  // former, and sites restored by poke_site() did not go through it at all.
+  wait_quiescent();
+  drain_in_flight();
+  // A single quiescent period covers everyone that was still running between
+  // the in_flight decrement and the jump out of a wrapper.
+  wait_quiescent();
+
+  // these take their own locks, which come before kamprobes_lock
+  kam_callgraph_free();
+  kam_bpf_free();
+  kam_acct_free();
+  kam_trace_free();
+
+  mutex_lock(&kamprobes_lock);
+  vfree(wrapper_start);
+  wrapper_start = NULL;
+  kam_capture_free();
+  vfree(wrappers);
+  wrappers = NULL;
+  no_probes = 0;
+  max_no_probes = 0;
+  mutex_unlock(&kamprobes_lock);
 }
+EXPORT_SYMBOL(kamprobes_free);
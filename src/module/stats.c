@@ -0,0 +1,208 @@
+/**** Notice
+ * stats.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* kamprobes counters and their debugfs interface (see kam/stats.h) */
+#include "kam/stats.h"
+
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+#include "kam/probes.h"
+
+static struct dentry *kam_debugfs_dir = NULL;
+
+static size_t arena_used = 0;
+static size_t arena_total = 0;
+static u64 rejected[REJECT_REASONS];
+static u64 latency[LAT_KINDS][KAM_LAT_BUCKETS];
+// indexed by [ADDR_LOC][addr_type & ADDR_TYPE_MASK]
+static long active[1 << ADDR_LOC_BITS][1 << ADDR_TYPE_BITS];
+
+static const char *reject_names[REJECT_REASONS] = {
+  [REJECT_NOT_CALL_NOP]   = "not_call_or_nop",
+  [REJECT_MODULE_MISSING] = "module_missing",
+  [REJECT_DUPLICATE]      = "duplicate",
+  [REJECT_NO_SPACE]       = "no_space",
+  [REJECT_INVALID_SPEC]   = "invalid_spec",
+};
+
+static const char *latency_names[LAT_KINDS] = {
+  [LAT_REGISTER] = "register",
+  [LAT_PATCH]    = "patch",
+  [LAT_RESTORE]  = "restore",
+  [LAT_POKE]     = "poke",
+};
+
+static const char *type_names[1 << ADDR_TYPE_BITS] = {
+  [ADDR_INVALID]        = "invalid",
+  [ADDR_OF_CALL]        = "call",
+  [ADDR_OF_FUNC]        = "func",
+  [ADDR_KERNEL_SYSCALL] = "syscall",
+};
+
+static const char *state_names[] = {
+  [PROBE_NO_HANDLERS]      = "no_handlers",
+  [PROBE_DEFAULT_HANDLERS] = "default_handlers",
+  [PROBE_INIT_DONE]        = "init_done",
+  [PROBE_ACTIVE]           = "active",
+  [PROBE_REMOVED]          = "removed",
+};
+
+void kam_stats_reject(kam_reject_reason reason)
+{
+  rejected[reason]++;
+}
+
+void kam_stats_latency(kam_latency_kind kind, u64 ns)
+{
+  int bucket = ns ? ilog2(ns) : 0;
+
+  if (bucket >= KAM_LAT_BUCKETS)
+    bucket = KAM_LAT_BUCKETS - 1;
+  latency[kind][bucket]++;
+}
+
+void kam_stats_arena(size_t used, size_t total)
+{
+  arena_used = used;
+  arena_total = total;
+}
+
+void kam_stats_active(char addr_type, int delta)
+{
+  active[ADDR_LOC(addr_type)][addr_type & ADDR_TYPE_MASK] += delta;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+  int i, j;
+  u64 total;
+
+  seq_printf(m, "arena_bytes_total %zu\n", arena_total);
+  seq_printf(m, "arena_bytes_used %zu\n", arena_used);
+  seq_printf(m, "arena_bytes_free %zu\n", arena_total - arena_used);
+  seq_printf(m, "probes_registered %u\n", kamprobes_count());
+
+  for (i = 0; i < REJECT_REASONS; i++)
+    seq_printf(m, "rejected_%s %llu\n", reject_names[i], rejected[i]);
+
+  for (i = 0; i < (1 << ADDR_LOC_BITS); i++) {
+    for (j = 0; j < (1 << ADDR_TYPE_BITS); j++) {
+      if (type_names[j] == NULL)
+        continue;
+      seq_printf(m, "active_%s_%s %ld\n", i == ADDR_MODULE ? "module" : "kernel",
+                 type_names[j], active[i][j]);
+    }
+  }
+
+  for (i = 0; i < LAT_KINDS; i++) {
+    total = 0;
+    for (j = 0; j < KAM_LAT_BUCKETS; j++)
+      total += latency[i][j];
+    seq_printf(m, "latency_%s_count %llu\n", latency_names[i], total);
+    for (j = 0; j < KAM_LAT_BUCKETS; j++) {
+      if (latency[i][j] == 0)
+        continue;
+      seq_printf(m, "  [%llu, %llu) %llu\n", j ? 1ULL << j : 0,
+                 1ULL << (j + 1), latency[i][j]);
+    }
+  }
+  return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+  .owner   = THIS_MODULE,
+  .open    = stats_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+static void *probes_start(struct seq_file *m, loff_t *pos)
+{
+  if (*pos == 0)
+    seq_puts(m, "tag type loc site wrapper wrapper_bytes state\n");
+  return (void *)kamprobes_get(*pos);
+}
+
+static void *probes_next(struct seq_file *m, void *v, loff_t *pos)
+{
+  (*pos)++;
+  return (void *)kamprobes_get(*pos);
+}
+
+static void probes_stop(struct seq_file *m, void *v)
+{
+}
+
+static int probes_show(struct seq_file *m, void *v)
+{
+  const struct kam_wrapper *w = v;
+  const char *type = type_names[w->addr_type & ADDR_TYPE_MASK];
+
+  seq_printf(m, "%d %s %s %pK %pK %u %s\n", w->tag,
+             type ? type : "unknown",
+             ADDR_LOC(w->addr_type) == ADDR_MODULE ? "module" : "kernel",
+             w->site, w->code, w->size, state_names[w->state]);
+  return 0;
+}
+
+static const struct seq_operations probes_seq_ops = {
+  .start = probes_start,
+  .next  = probes_next,
+  .stop  = probes_stop,
+  .show  = probes_show,
+};
+
+static int probes_open(struct inode *inode, struct file *file)
+{
+  return seq_open(file, &probes_seq_ops);
+}
+
+static const struct file_operations probes_fops = {
+  .owner   = THIS_MODULE,
+  .open    = probes_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = seq_release,
+};
+
+int kam_stats_init(void)
+{
+  memset(rejected, 0, sizeof(rejected));
+  memset(latency, 0, sizeof(latency));
+  memset(active, 0, sizeof(active));
+
+  kam_debugfs_dir = debugfs_create_dir("kamprobes", NULL);
+  if (IS_ERR_OR_NULL(kam_debugfs_dir)) {
+    kam_debugfs_dir = NULL;
+    return -ENODEV;
+  }
+  debugfs_create_file("stats", 0444, kam_debugfs_dir, NULL, &stats_fops);
+  debugfs_create_file("probes", 0444, kam_debugfs_dir, NULL, &probes_fops);
+  return 0;
+}
+
+// parent directory for the debugfs files of other kamprobes components
+struct dentry *kam_stats_debugfs_dir(void)
+{
+  return kam_debugfs_dir;
+}
+
+void kam_stats_free(void)
+{
+  debugfs_remove_recursive(kam_debugfs_dir);
+  kam_debugfs_dir = NULL;
+}
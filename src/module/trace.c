@@ -0,0 +1,282 @@
+/**** Notice
+ * trace.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* Encoder for the compact trace format (see kam/trace.h)
+ *
+ * Each cpu owns a ring of KAM_TRACE_CHUNKS chunks. Chunks with seq in
+ * [tail, head) are closed and waiting to be read. Chunk head is the one being
+ * written, if pos is set; it is opened by the first event that needs it. When
+ * the ring is full, opening a chunk overwrites the oldest unread one.
+ *
+ * The per-cpu lock is only contended when the debugfs reader closes or
+ * copies the chunks of a cpu. Writers take it with interrupts disabled, so
+ * handlers running in interrupt context cannot nest inside an event being
+ * encoded.
+ *
+ * The rings (KAM_TRACE_CHUNKS * KAM_TRACE_CHUNK_SZ bytes per possible cpu)
+ * are only allocated once a handler records an event. Events may come from
+ * atomic context, so the first one queues the allocation on the system
+ * workqueue, and events are dropped until it is done.
+ */
+#include "kam/trace.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/hardirq.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "kam/stats.h"
+
+struct trace_cpu {
+  raw_spinlock_t lock;
+  u8 *chunks;             // KAM_TRACE_CHUNKS * KAM_TRACE_CHUNK_SZ bytes
+  u64 head;
+  u64 tail;
+  u8 *pos;                // write position in chunk head, NULL if not open
+  struct kam_trace_enc enc;
+};
+
+static DEFINE_PER_CPU(struct trace_cpu, trace_cpus);
+
+// set once the allocation is queued, or when it must not happen
+static unsigned long trace_alloc_queued;
+static void trace_alloc(struct work_struct *work);
+static DECLARE_WORK(trace_alloc_work, trace_alloc);
+
+static struct kam_trace_chunk *chunk_at(struct trace_cpu *tc, u64 seq)
+{
+  return (struct kam_trace_chunk *)(tc->chunks + (seq % KAM_TRACE_CHUNKS) *
+                                                 KAM_TRACE_CHUNK_SZ);
+}
+
+static void open_chunk(struct trace_cpu *tc, u64 now)
+{
+  struct kam_trace_chunk *chunk;
+
+  // readers see the overwritten chunk as a gap in seq
+  if (tc->head - tc->tail == KAM_TRACE_CHUNKS)
+    tc->tail++;
+  chunk = chunk_at(tc, tc->head);
+  *chunk = (struct kam_trace_chunk){.magic = KAM_TRACE_MAGIC,
+                                    .version = KAM_TRACE_VERSION,
+                                    .cpu = smp_processor_id(),
+                                    .base_ts = now,
+                                    .seq = tc->head,
+                                   };
+  tc->pos = (u8 *)(chunk + 1);
+  kam_trace_enc_reset(&tc->enc, now);
+}
+
+static void close_chunk(struct trace_cpu *tc)
+{
+  struct kam_trace_chunk *chunk;
+
+  if (tc->pos == NULL)
+    return;
+  chunk = chunk_at(tc, tc->head);
+  chunk->size = tc->pos - (u8 *)(chunk + 1);
+  tc->head++;
+  tc->pos = NULL;
+}
+
+void kam_trace_event(u32 tag, unsigned int nr_args, const u64 *args)
+{
+  struct trace_cpu *tc;
+  struct kam_trace_chunk *chunk;
+  unsigned long flags;
+  u64 now;
+
+  if (in_nmi() || nr_args > KAM_TRACE_MAX_ARGS)
+    return;
+
+  local_irq_save(flags);
+  tc = this_cpu_ptr(&trace_cpus);
+  raw_spin_lock(&tc->lock);
+  if (tc->chunks == NULL) {
+    if (!test_and_set_bit(0, &trace_alloc_queued))
+      schedule_work(&trace_alloc_work);
+    goto out;
+  }
+
+  // the fast clock may step back by a little on timekeeping updates, which
+  // kam_trace_encode records as a zero delta
+  now = ktime_get_mono_fast_ns();
+
+  if (tc->pos != NULL) {
+    chunk = chunk_at(tc, tc->head);
+    if (tc->pos + KAM_TRACE_MAX_EVENT > (u8 *)chunk + KAM_TRACE_CHUNK_SZ ||
+        kam_trace_enc_find(&tc->enc, tag) == KAM_TRACE_DICT_SZ)
+      close_chunk(tc);
+  }
+  if (tc->pos == NULL)
+    open_chunk(tc, now);
+  chunk = chunk_at(tc, tc->head);
+  tc->pos = kam_trace_encode(&tc->enc, tc->pos, tag, now, current->pid,
+                             nr_args, args);
+  chunk->nr_events++;
+
+out:
+  raw_spin_unlock(&tc->lock);
+  local_irq_restore(flags);
+}
+EXPORT_SYMBOL(kam_trace_event);
+
+struct trace_reader {
+  int cpu;
+  u8 buf[KAM_TRACE_CHUNK_SZ];
+};
+
+static int trace_open(struct inode *inode, struct file *file)
+{
+  struct trace_reader *r;
+  struct trace_cpu *tc;
+  unsigned long flags;
+  int cpu;
+
+  r = kzalloc(sizeof(*r), GFP_KERNEL);
+  if (r == NULL)
+    return -ENOMEM;
+  // make the events recorded so far readable
+  for_each_possible_cpu(cpu) {
+    tc = per_cpu_ptr(&trace_cpus, cpu);
+    raw_spin_lock_irqsave(&tc->lock, flags);
+    close_chunk(tc);
+    raw_spin_unlock_irqrestore(&tc->lock, flags);
+  }
+  file->private_data = r;
+  return nonseekable_open(inode, file);
+}
+
+static ssize_t trace_read(struct file *file, char __user *ubuf, size_t count,
+                          loff_t *ppos)
+{
+  struct trace_reader *r = file->private_data;
+  struct kam_trace_chunk *chunk;
+  struct trace_cpu *tc;
+  unsigned long flags;
+  size_t copied = 0, len;
+
+  for (; r->cpu < nr_cpu_ids; r->cpu++) {
+    if (!cpu_possible(r->cpu))
+      continue;
+    tc = per_cpu_ptr(&trace_cpus, r->cpu);
+    for (;;) {
+      raw_spin_lock_irqsave(&tc->lock, flags);
+      if (tc->chunks == NULL || tc->tail == tc->head) {
+        raw_spin_unlock_irqrestore(&tc->lock, flags);
+        break;
+      }
+      chunk = chunk_at(tc, tc->tail);
+      len = sizeof(*chunk) + chunk->size;
+      if (copied + len > count) {
+        raw_spin_unlock_irqrestore(&tc->lock, flags);
+        // callers must read at least KAM_TRACE_CHUNK_SZ bytes at a time
+        return copied ? copied : -EINVAL;
+      }
+      memcpy(r->buf, chunk, len);
+      tc->tail++;
+      raw_spin_unlock_irqrestore(&tc->lock, flags);
+
+      if (copy_to_user(ubuf + copied, r->buf, len))
+        return -EFAULT;
+      copied += len;
+    }
+  }
+  *ppos += copied;
+  return copied;
+}
+
+static int trace_release(struct inode *inode, struct file *file)
+{
+  kfree(file->private_data);
+  return 0;
+}
+
+static const struct file_operations trace_fops = {
+  .owner   = THIS_MODULE,
+  .open    = trace_open,
+  .read    = trace_read,
+  .llseek  = no_llseek,
+  .release = trace_release,
+};
+
+static void trace_alloc(struct work_struct *work)
+{
+  struct trace_cpu *tc;
+  unsigned long flags;
+  u8 *chunks;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    chunks = vmalloc_node(KAM_TRACE_CHUNKS * KAM_TRACE_CHUNK_SZ,
+                          cpu_to_node(cpu));
+    if (chunks == NULL) {
+      // the rings allocated so far stay in use
+      printk(KERN_WARNING "kamprobes: no trace buffers for cpu %d\n", cpu);
+      continue;
+    }
+    tc = per_cpu_ptr(&trace_cpus, cpu);
+    raw_spin_lock_irqsave(&tc->lock, flags);
+    tc->chunks = chunks;
+    raw_spin_unlock_irqrestore(&tc->lock, flags);
+  }
+}
+
+/*
+ * Chunks are only kept when the debugfs interface is available, as they
+ * could not be read otherwise. Without it, kam_trace_event drops every event.
+ */
+int kam_trace_init(void)
+{
+  struct dentry *dir = kam_stats_debugfs_dir();
+  struct trace_cpu *tc;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    tc = per_cpu_ptr(&trace_cpus, cpu);
+    memset(tc, 0, sizeof(*tc));
+    raw_spin_lock_init(&tc->lock);
+  }
+  if (dir == NULL) {
+    set_bit(0, &trace_alloc_queued);
+    return -ENODEV;
+  }
+  clear_bit(0, &trace_alloc_queued);
+  debugfs_create_file("trace", 0400, dir, NULL, &trace_fops);
+  return 0;
+}
+
+void kam_trace_free(void)
+{
+  struct trace_cpu *tc;
+  unsigned long flags;
+  u8 *chunks;
+  int cpu;
+
+  // no handler can record events anymore, but one may have queued the
+  // allocation just before
+  set_bit(0, &trace_alloc_queued);
+  cancel_work_sync(&trace_alloc_work);
+  for_each_possible_cpu(cpu) {
+    tc = per_cpu_ptr(&trace_cpus, cpu);
+    raw_spin_lock_irqsave(&tc->lock, flags);
+    chunks = tc->chunks;
+    tc->chunks = NULL;
+    tc->pos = NULL;
+    raw_spin_unlock_irqrestore(&tc->lock, flags);
+    vfree(chunks);
+  }
+}
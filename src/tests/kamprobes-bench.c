@@ -0,0 +1,150 @@
+/**** Notice
+ * kamprobes-bench.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/* Micro-benchmark for the cost of a call-site kamprobe
+ *
+ * Probes a call site inside this module and times a loop going through it
+ * with no probe, with a full (entry + return capable) wrapper and with a
+ * PROBE_DIRECT wrapper. Results are printed in cycles per call:
+ *
+ *   insmod kamprobes.ko
+ *   insmod kambench.ko [iterations=N]; dmesg | grep kam-bench
+ *
+ * The module unloads itself once done. Each run takes two of the wrappers
+ * reserved by kamprobes.ko (see its max_probes parameter).
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/timex.h>
+
+#include "kam/asm2bin.h"
+#include "kam/config.h"
+#include "kam/probes.h"
+
+// bench_caller is only a few instructions long
+#define BENCH_CALLER_MAX 64
+
+static int iterations = 1000000;
+module_param(iterations, int, 0444);
+
+static volatile int bench_sink;
+
+static noinline __noclone int bench_target(int x)
+{
+  return x + bench_sink;
+}
+
+static noinline __noclone int bench_caller(int x)
+{
+  // not a tail call: the call site must stay a callq
+  return bench_target(x) * 2;
+}
+
+static int bench_pre(int x)
+{
+  KAM_PRE_ENTRY(tag);
+  bench_sink = 0;
+  KAM_PRE_RETURN(0);
+}
+
+static u8 *find_call_site(void *caller, void *callee)
+{
+  u8 *p;
+
+  for (p = caller; p + CALL_WIDTH <= (u8 *)caller + BENCH_CALLER_MAX; p++) {
+    if (is_call_insn(p) && call_insn_target(p) == callee)
+      return p;
+  }
+  return NULL;
+}
+
+static cycles_t time_loop(void)
+{
+  cycles_t start;
+  int i;
+
+  start = get_cycles();
+  for (i = 0; i < iterations; i++)
+    bench_caller(i);
+  return get_cycles() - start;
+}
+
+static void report(const char *what, cycles_t cycles, cycles_t base)
+{
+  printk(KERN_NOTICE "kam-bench: %-8s %llu cycles/call (+%lld over no probe)\n",
+         what, (u64)cycles / iterations,
+         ((s64)cycles - (s64)base) / iterations);
+}
+
+static int __init kam_bench_init(void)
+{
+  int rc;
+  u8 *site;
+  cycles_t base, full, direct;
+  kamprobe full_kam, direct_kam;
+
+  site = find_call_site(bench_caller, bench_target);
+  if (site == NULL) {
+    printk(KERN_ERR "kam-bench: call site of bench_target not found\n");
+    return -ENOENT;
+  }
+
+  // a no-op, kamprobes.ko is initialized when loaded
+  rc = kamprobes_init(2);
+  if (rc)
+    return rc;
+
+  base = time_loop();
+
+  full_kam = (kamprobe){.tag = 1,
+                        .state = PROBE_NO_HANDLERS,
+                        .addr = site,
+                        .addr_type = ADDR_OF_CALL,
+                        .on_entry = bench_pre,
+                       };
+  rc = kamprobe_register(&full_kam);
+  if (rc)
+    goto out;
+  full = time_loop();
+  kamprobe_unregister(&full_kam);
+
+  direct_kam = (kamprobe){.tag = 2,
+                          .state = PROBE_NO_HANDLERS,
+                          .addr = site,
+                          .addr_type = ADDR_OF_CALL,
+                          .flags = PROBE_DIRECT,
+                          .on_entry = bench_pre,
+                         };
+  rc = kamprobe_register(&direct_kam);
+  if (rc)
+    goto out;
+  direct = time_loop();
+  kamprobe_unregister(&direct_kam);
+
+  report("none", base, base);
+  report("full", full, base);
+  report("direct", direct, base);
+
+out:
+  // results are in the log, no need to stay loaded
+  return rc ? rc : -EAGAIN;
+}
+
+static void __exit kam_bench_cleanup(void)
+{
+}
+
+module_init(kam_bench_init);
+module_exit(kam_bench_cleanup);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Lucian Carata <lucian.carata@cl.cam.ac.uk>");
+MODULE_VERSION(KAMPROBES_KVERSION);
+MODULE_DESCRIPTION(KAMPROBES_DESC);
@@ -18,6 +18,8 @@
 #include "kam/kallsyms.h"
 
 int kam_is_stopped = 0;
+// registered until the module is unloaded
+static kamprobe test_kam;
 
 int wq_create_pre(const char *fmt, unsigned int flags, int max_active,
                   void *key, const char *lock_name, ...)
@@ -42,7 +44,6 @@ static int __init kam_init(void)
 {
 
   int rc;
-  kamprobe test_kam;
 
   // Get addresses for private kernel symbols.
   rc = init_priv_kallsyms();
@@ -75,6 +76,7 @@ static int __init kam_init(void)
 
 static void __exit kam_cleanup(void)
 {
+  kamprobe_unregister(&test_kam);
 }
 
 module_init(kam_init);
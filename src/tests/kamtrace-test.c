@@ -0,0 +1,294 @@
+/**** Notice
+ * kamtrace-test.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/*
+ * Round trip test for the trace format (see kam/trace.h)
+ *
+ *   kamtrace-test <path to kamtrace> <output prefix>
+ *
+ * Encodes a synthetic workload with the encoder used by trace.c, chunked the
+ * way trace.c chunks it, and checks that kamtrace prints back every event in
+ * time order. The chunks are split over two files, written out of order, and
+ * one chunk is left out to check that it is reported as lost and that only
+ * its events are missing.
+ *
+ * The workload is fixed (seeded), so the bytes/event figure kamtrace reports
+ * at the end can be reproduced:
+ *   - NR_CPUS cpus, events spread randomly over them, 50-2050 ns apart
+ *   - NR_SITES probe sites, hit with a skewed distribution; each hit is an
+ *     entry event (tag 2 * site, 2 args: an fd-like value < 64 and a size
+ *     < 64K) followed on the same cpu by a return event (tag 2 * site + 1,
+ *     1 arg: a size < 4096, or -EAGAIN one time in four)
+ *   - the pid of a cpu changes before one entry in eight, among 64 pids
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kam/trace.h"
+
+#define NR_CPUS 4
+#define NR_SITES 8
+#define NR_EVENTS 20000
+// chunk left out of the dump
+#define LOST_CPU 1
+#define LOST_SEQ 2
+
+struct event {
+  uint64_t ts;
+  uint32_t tag;
+  uint32_t pid;
+  uint16_t cpu;
+  uint64_t seq;      // of the chunk the event went into
+  unsigned int nr_args;
+  __u64 args[KAM_TRACE_MAX_ARGS];
+};
+
+struct cpu {
+  __u8 *chunks;      // closed chunks, KAM_TRACE_CHUNK_SZ bytes each
+  uint64_t head;     // seq of the chunk being written
+  __u8 *pos;         // NULL if no chunk is open
+  struct kam_trace_enc enc;
+  uint32_t pid;
+  int pending_site;  // site whose return event is due, -1 if none
+};
+
+static struct cpu cpus[NR_CPUS];
+static struct event events[NR_EVENTS];
+static uint64_t rnd_state = 0x6b616d74;
+
+static uint32_t rnd(void)
+{
+  // xorshift64*, fixed seed
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return (rnd_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static struct kam_trace_chunk *chunk_at(struct cpu *c, uint64_t seq)
+{
+  return (struct kam_trace_chunk *)(c->chunks + seq * KAM_TRACE_CHUNK_SZ);
+}
+
+static void open_chunk(struct cpu *c, uint16_t cpu, uint64_t now)
+{
+  struct kam_trace_chunk *chunk;
+
+  c->chunks = realloc(c->chunks, (c->head + 1) * KAM_TRACE_CHUNK_SZ);
+  if (c->chunks == NULL) {
+    perror("kamtrace-test");
+    exit(1);
+  }
+  chunk = chunk_at(c, c->head);
+  *chunk = (struct kam_trace_chunk){.magic = KAM_TRACE_MAGIC,
+                                    .version = KAM_TRACE_VERSION,
+                                    .cpu = cpu,
+                                    .base_ts = now,
+                                    .seq = c->head,
+                                   };
+  c->pos = (__u8 *)(chunk + 1);
+  kam_trace_enc_reset(&c->enc, now);
+}
+
+static void close_chunk(struct cpu *c)
+{
+  struct kam_trace_chunk *chunk;
+
+  if (c->pos == NULL)
+    return;
+  chunk = chunk_at(c, c->head);
+  chunk->size = c->pos - (__u8 *)(chunk + 1);
+  c->head++;
+  c->pos = NULL;
+}
+
+// same steps as kam_trace_event
+static void record(struct event *ev)
+{
+  struct cpu *c = &cpus[ev->cpu];
+  struct kam_trace_chunk *chunk;
+
+  if (c->pos != NULL) {
+    chunk = chunk_at(c, c->head);
+    if (c->pos + KAM_TRACE_MAX_EVENT > (__u8 *)chunk + KAM_TRACE_CHUNK_SZ ||
+        kam_trace_enc_find(&c->enc, ev->tag) == KAM_TRACE_DICT_SZ)
+      close_chunk(c);
+  }
+  if (c->pos == NULL)
+    open_chunk(c, ev->cpu, ev->ts);
+  chunk = chunk_at(c, c->head);
+  c->pos = kam_trace_encode(&c->enc, c->pos, ev->tag, ev->ts, ev->pid,
+                            ev->nr_args, ev->args);
+  chunk->nr_events++;
+  ev->seq = c->head;
+}
+
+static void generate(void)
+{
+  uint64_t ts = 1000000000000ULL;
+  struct event *ev;
+  struct cpu *c;
+  int i, site;
+
+  for (i = 0; i < NR_CPUS; i++) {
+    cpus[i].pid = 1000 + i;
+    cpus[i].pending_site = -1;
+  }
+  for (i = 0; i < NR_EVENTS; i++) {
+    ev = &events[i];
+    ts += 50 + rnd() % 2000;
+    ev->ts = ts;
+    ev->cpu = rnd() % NR_CPUS;
+    c = &cpus[ev->cpu];
+    if (c->pending_site >= 0) {
+      ev->tag = 2 * c->pending_site + 1;
+      ev->nr_args = 1;
+      ev->args[0] = rnd() % 4 == 0 ? (__u64)-EAGAIN : rnd() % 4096;
+      c->pending_site = -1;
+    } else {
+      site = rnd() % NR_SITES;
+      if (rnd() % 2)
+        site = site / 2;
+      if (rnd() % 8 == 0)
+        c->pid = 1000 + rnd() % 64;
+      ev->tag = 2 * site;
+      ev->nr_args = 2;
+      ev->args[0] = rnd() % 64;
+      ev->args[1] = rnd() % 65536;
+      c->pending_site = site;
+    }
+    ev->pid = c->pid;
+    record(ev);
+  }
+  for (i = 0; i < NR_CPUS; i++)
+    close_chunk(&cpus[i]);
+}
+
+static void write_chunks(const char *path, uint64_t parity)
+{
+  struct kam_trace_chunk *chunk;
+  FILE *f = fopen(path, "wb");
+  uint64_t seq;
+  int i;
+
+  if (f == NULL) {
+    fprintf(stderr, "kamtrace-test: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  // newest first, last cpu first: kamtrace must not depend on the order
+  for (i = NR_CPUS - 1; i >= 0; i--) {
+    for (seq = cpus[i].head; seq-- > 0;) {
+      if (seq % 2 != parity || (i == LOST_CPU && seq == LOST_SEQ))
+        continue;
+      chunk = chunk_at(&cpus[i], seq);
+      fwrite(chunk, 1, sizeof(*chunk) + chunk->size, f);
+    }
+  }
+  if (fclose(f) != 0) {
+    fprintf(stderr, "kamtrace-test: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+static void format_event(const struct event *ev, char *buf, size_t size)
+{
+  unsigned int i;
+  int n;
+
+  n = snprintf(buf, size, "%" PRIu64 " %u %u %u", ev->ts, ev->cpu, ev->pid,
+               ev->tag);
+  for (i = 0; i < ev->nr_args; i++)
+    n += snprintf(buf + n, size - n, " %#llx", (unsigned long long)ev->args[i]);
+  snprintf(buf + n, size - n, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+  char path_a[4096], path_b[4096], path_err[4096], cmd[16384];
+  char expected[512], line[512];
+  uint64_t nr_expected = 0, nr_chunks = 0;
+  int i, failed = 0;
+  FILE *out, *err;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <kamtrace> <output prefix>\n", argv[0]);
+    return 1;
+  }
+  snprintf(path_a, sizeof(path_a), "%s-a.bin", argv[2]);
+  snprintf(path_b, sizeof(path_b), "%s-b.bin", argv[2]);
+  snprintf(path_err, sizeof(path_err), "%s.err", argv[2]);
+
+  generate();
+  write_chunks(path_a, 1);
+  write_chunks(path_b, 0);
+  for (i = 0; i < NR_CPUS; i++)
+    nr_chunks += cpus[i].head;
+  if (cpus[LOST_CPU].head <= LOST_SEQ + 1) {
+    fprintf(stderr, "kamtrace-test: too few chunks to leave one out\n");
+    return 1;
+  }
+
+  snprintf(cmd, sizeof(cmd), "'%s' '%s' '%s' 2>'%s'", argv[1], path_a, path_b,
+           path_err);
+  out = popen(cmd, "r");
+  if (out == NULL) {
+    perror("kamtrace-test");
+    return 1;
+  }
+  // events were generated in time order, and no two have the same ts
+  for (i = 0; i < NR_EVENTS; i++) {
+    if (events[i].cpu == LOST_CPU && events[i].seq == LOST_SEQ)
+      continue;
+    nr_expected++;
+    format_event(&events[i], expected, sizeof(expected));
+    if (fgets(line, sizeof(line), out) == NULL) {
+      printf("FAIL: output ends before event %d: %s", i, expected);
+      failed = 1;
+      break;
+    }
+    if (strcmp(line, expected) != 0) {
+      printf("FAIL: event %d\n  expected: %s  decoded:  %s", i, expected, line);
+      failed = 1;
+      break;
+    }
+  }
+  if (!failed && fgets(line, sizeof(line), out) != NULL) {
+    printf("FAIL: extra output: %s", line);
+    failed = 1;
+  }
+  if (pclose(out) != 0) {
+    printf("FAIL: kamtrace exited with an error\n");
+    failed = 1;
+  }
+
+  err = fopen(path_err, "r");
+  if (err == NULL || fgets(line, sizeof(line), err) == NULL) {
+    printf("FAIL: no totals from kamtrace\n");
+    return 1;
+  }
+  snprintf(expected, sizeof(expected),
+           "events %" PRIu64 " chunks %" PRIu64 " lost_chunks 1 bad_chunks 0\n",
+           nr_expected, nr_chunks - 1);
+  if (strcmp(line, expected) != 0) {
+    printf("FAIL: totals\n  expected: %s  reported: %s", expected, line);
+    failed = 1;
+  }
+  // the compression figure
+  do {
+    fputs(line, stdout);
+  } while (fgets(line, sizeof(line), err) != NULL);
+  fclose(err);
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
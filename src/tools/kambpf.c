@@ -0,0 +1,172 @@
+/**** Notice
+ * kambpf.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/*
+ * Smoke test for BPF handlers (see kam/bpf.h and doc/bpf-handlers.md)
+ *
+ *   kambpf <sym> <offset> [call|func] [seconds]
+ *
+ * Loads two small kprobe programs counting hits into an array map, attaches
+ * them to the site at sym+offset (the return one only for call sites), and
+ * prints the counts every second. Needs no libbpf: the programs are built
+ * from raw instructions.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "kam/bpf.h"
+
+// values of addr_type in kam/probes.h
+#define ADDR_OF_CALL 1
+#define ADDR_OF_FUNC 2
+
+enum { KEY_ENTRY, KEY_RETURN, NR_KEYS };
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// older kernels refuse kprobe programs built for another version
+static uint32_t kernel_version(void)
+{
+  struct utsname u;
+  unsigned int major = 0, minor = 0, patch = 0;
+
+  if (uname(&u) == 0)
+    sscanf(u.release, "%u.%u.%u", &major, &minor, &patch);
+  if (patch > 255)
+    patch = 255;
+  return (major << 16) | (minor << 8) | patch;
+}
+
+#define INSN(c, d, s, o, i) \
+  ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), \
+                     .off = (o), .imm = (i)})
+
+// *(u64 *)map[key] += 1
+static int load_counter(int map_fd, int key)
+{
+  struct bpf_insn prog[] = {
+    INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, key),
+    INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+    INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+    INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+    INSN(0, 0, 0, 0, 0),
+    INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+    INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0),
+    INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+    INSN(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0),
+    INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),
+    INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  static char log[4096];
+  union bpf_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_KPROBE;
+  attr.insns = (uintptr_t)prog;
+  attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+  attr.license = (uintptr_t)"GPL";
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  attr.kern_version = kernel_version();
+  fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0)
+    fprintf(stderr, "kambpf: BPF_PROG_LOAD: %s\n%s", strerror(errno), log);
+  return fd;
+}
+
+static uint64_t read_counter(int map_fd, uint32_t key)
+{
+  union bpf_attr attr;
+  uint64_t value = 0;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&value;
+  sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+  return value;
+}
+
+int main(int argc, char *argv[])
+{
+  struct kam_bpf_attach at;
+  union bpf_attr attr;
+  int map_fd, dev_fd, seconds = 10, i;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <sym> <offset> [call|func] [seconds]\n",
+            argv[0]);
+    return 1;
+  }
+
+  memset(&at, 0, sizeof(at));
+  strncpy(at.sym, argv[1], sizeof(at.sym) - 1);
+  at.offset = strtoul(argv[2], NULL, 0);
+  at.addr_type = ADDR_OF_CALL;
+  if (argc > 3 && strcmp(argv[3], "func") == 0)
+    at.addr_type = ADDR_OF_FUNC;
+  if (argc > 4)
+    seconds = atoi(argv[4]);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = NR_KEYS;
+  map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (map_fd < 0) {
+    perror("kambpf: BPF_MAP_CREATE");
+    return 1;
+  }
+
+  at.entry_fd = load_counter(map_fd, KEY_ENTRY);
+  at.return_fd = -1;
+  if (at.addr_type == ADDR_OF_CALL)
+    at.return_fd = load_counter(map_fd, KEY_RETURN);
+  if (at.entry_fd < 0 || (at.addr_type == ADDR_OF_CALL && at.return_fd < 0))
+    return 1;
+
+  dev_fd = open("/dev/" KAM_BPF_DEVICE, O_RDWR);
+  if (dev_fd < 0) {
+    perror("kambpf: /dev/" KAM_BPF_DEVICE);
+    return 1;
+  }
+  if (ioctl(dev_fd, KAM_BPF_ATTACH, &at) < 0) {
+    perror("kambpf: KAM_BPF_ATTACH");
+    return 1;
+  }
+  printf("attached to %s+%#x as probe %u\n", at.sym, at.offset, at.id);
+
+  for (i = 0; i < seconds; i++) {
+    sleep(1);
+    printf("entry %llu return %llu\n",
+           (unsigned long long)read_counter(map_fd, KEY_ENTRY),
+           (unsigned long long)read_counter(map_fd, KEY_RETURN));
+  }
+
+  if (ioctl(dev_fd, KAM_BPF_DETACH, &at.id) < 0) {
+    perror("kambpf: KAM_BPF_DETACH");
+    return 1;
+  }
+  return 0;
+}
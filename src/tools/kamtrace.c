@@ -0,0 +1,352 @@
+/**** Notice
+ * kamtrace.c: kamprobes source code
+ *
+ * Copyright 2015-2017 The kamprobes owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the kamprobes open-source project: github.com/lc525/kamprobes;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+/*
+ * Decoder for the compact trace format (see kam/trace.h)
+ *
+ *   kamtrace [-s] <file>...
+ *
+ * Reads chunks dumped from <debugfs>/kamprobes/trace (several dumps of the
+ * same run can be given, in any order). By default, it prints all the events
+ * as a single time-ordered stream, one per line:
+ *
+ *   <ts ns> <cpu> <pid> <tag> [args, in hex]
+ *
+ * With -s, it prints the number of events and the time span for each tag
+ * instead. The totals, including chunks lost to overwrites (gaps in seq) and
+ * the encoded size per event, are written to stderr.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kam/trace.h"
+
+// what an uncompressed record would take: ts, tag, cpu, pid, args
+#define RAW_EVENT_SZ(nr_args) (8 + 4 + 4 + 4 + 8 * (nr_args))
+
+struct event {
+  uint64_t ts;
+  uint32_t tag;
+  uint32_t pid;
+  uint16_t cpu;
+  uint8_t nr_args;
+  __u64 args[KAM_TRACE_MAX_ARGS];
+};
+
+// chunks and decoded events of one cpu
+struct stream {
+  const struct kam_trace_chunk **chunks;
+  size_t nr_chunks;
+  struct event *events;
+  size_t nr_events;
+  size_t pos;        // next event to merge
+};
+
+struct totals {
+  uint64_t bytes;
+  uint64_t raw_bytes;
+  uint64_t chunks;
+  uint64_t lost_chunks;
+  uint64_t bad_chunks;
+};
+
+static struct stream *streams = NULL;
+static size_t nr_streams = 0;
+static struct totals totals;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    perror("kamtrace");
+    exit(1);
+  }
+  return ptr;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+  FILE *f = fopen(path, "rb");
+  uint8_t *buf = NULL;
+  size_t cap = 0, n;
+
+  if (f == NULL) {
+    fprintf(stderr, "kamtrace: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  *size = 0;
+  do {
+    if (*size == cap) {
+      cap = cap ? 2 * cap : 1 << 20;
+      buf = xrealloc(buf, cap);
+    }
+    n = fread(buf + *size, 1, cap - *size, f);
+    *size += n;
+  } while (n > 0);
+  fclose(f);
+  return buf;
+}
+
+static void add_chunks(const char *path, const uint8_t *buf, size_t size)
+{
+  const struct kam_trace_chunk *c;
+  struct stream *s;
+  size_t off = 0;
+
+  while (off + sizeof(*c) <= size) {
+    c = (const struct kam_trace_chunk *)(buf + off);
+    if (c->magic != KAM_TRACE_MAGIC || c->version != KAM_TRACE_VERSION ||
+        c->size > KAM_TRACE_CHUNK_SZ - sizeof(*c) ||
+        c->nr_events == 0 || c->nr_events > c->size ||
+        off + sizeof(*c) + c->size > size) {
+      fprintf(stderr, "kamtrace: %s: bad chunk at offset %zu, ignoring the "
+              "rest of the file\n", path, off);
+      return;
+    }
+    if (c->cpu >= nr_streams) {
+      streams = xrealloc(streams, (c->cpu + 1) * sizeof(*streams));
+      memset(streams + nr_streams, 0,
+             (c->cpu + 1 - nr_streams) * sizeof(*streams));
+      nr_streams = c->cpu + 1;
+    }
+    s = &streams[c->cpu];
+    s->chunks = xrealloc(s->chunks, (s->nr_chunks + 1) * sizeof(*s->chunks));
+    s->chunks[s->nr_chunks++] = c;
+    totals.bytes += sizeof(*c) + c->size;
+    totals.chunks++;
+    off += sizeof(*c) + c->size;
+  }
+  if (off != size)
+    fprintf(stderr, "kamtrace: %s: truncated chunk at offset %zu\n", path, off);
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+  uint64_t sa = (*(const struct kam_trace_chunk **)a)->seq;
+  uint64_t sb = (*(const struct kam_trace_chunk **)b)->seq;
+
+  return sa < sb ? -1 : sa > sb;
+}
+
+// returns 0 on success; on error, the events of the chunk are dropped
+static int decode_chunk(const struct kam_trace_chunk *c, struct stream *s)
+{
+  const uint8_t *p = (const uint8_t *)(c + 1);
+  const uint8_t *end = p + c->size;
+  uint32_t tags[KAM_TRACE_DICT_SZ];
+  unsigned int nr_tags = 0, i;
+  uint64_t ts = c->base_ts;
+  __u64 head, v, idx;
+  uint64_t raw_bytes = 0;
+  size_t first = s->nr_events;
+  uint32_t pid = 0;
+  int have_pid = 0;
+  struct event *ev;
+
+  s->events = xrealloc(s->events,
+                       (s->nr_events + c->nr_events) * sizeof(*s->events));
+  for (i = 0; i < c->nr_events; i++) {
+    ev = &s->events[s->nr_events];
+    if ((p = kam_varint_get(p, end, &head)) == NULL)
+      goto bad;
+    idx = head >> KAM_TRACE_IDX_SHIFT;
+    if (head & KAM_TRACE_NEW_TAG) {
+      if (idx != nr_tags || nr_tags == KAM_TRACE_DICT_SZ ||
+          (p = kam_varint_get(p, end, &v)) == NULL)
+        goto bad;
+      tags[nr_tags++] = v;
+    } else if (idx >= nr_tags) {
+      goto bad;
+    }
+    ev->tag = tags[idx];
+
+    if ((p = kam_varint_get(p, end, &v)) == NULL)
+      goto bad;
+    ts += v;
+    ev->ts = ts;
+
+    if (head & KAM_TRACE_PID) {
+      if ((p = kam_varint_get(p, end, &v)) == NULL)
+        goto bad;
+      pid = v;
+      have_pid = 1;
+    } else if (!have_pid) {
+      goto bad;
+    }
+    ev->pid = pid;
+
+    ev->cpu = c->cpu;
+    ev->nr_args = head & KAM_TRACE_NR_ARGS_MASK;
+    for (idx = 0; idx < ev->nr_args; idx++) {
+      if ((p = kam_varint_get(p, end, &ev->args[idx])) == NULL)
+        goto bad;
+    }
+    raw_bytes += RAW_EVENT_SZ(ev->nr_args);
+    s->nr_events++;
+  }
+  if (p != end)
+    goto bad;
+  totals.raw_bytes += raw_bytes;
+  return 0;
+
+bad:
+  fprintf(stderr, "kamtrace: cpu %u chunk %" PRIu64 " is corrupt, dropped\n",
+          c->cpu, (uint64_t)c->seq);
+  s->nr_events = first;
+  totals.bad_chunks++;
+  return -1;
+}
+
+static void decode_stream(struct stream *s)
+{
+  size_t i;
+
+  qsort(s->chunks, s->nr_chunks, sizeof(*s->chunks), cmp_seq);
+  for (i = 0; i < s->nr_chunks; i++) {
+    // the same chunk can only appear twice if a dump was given twice
+    if (i > 0 && s->chunks[i]->seq == s->chunks[i - 1]->seq)
+      continue;
+    if (i > 0)
+      totals.lost_chunks += s->chunks[i]->seq - s->chunks[i - 1]->seq - 1;
+    decode_chunk(s->chunks[i], s);
+  }
+}
+
+// the stream whose next event is the oldest, NULL when all are done
+static struct stream *next_stream(void)
+{
+  struct stream *best = NULL, *s;
+  size_t i;
+
+  for (i = 0; i < nr_streams; i++) {
+    s = &streams[i];
+    if (s->pos == s->nr_events)
+      continue;
+    if (best == NULL || s->events[s->pos].ts < best->events[best->pos].ts)
+      best = s;
+  }
+  return best;
+}
+
+static void print_merged(void)
+{
+  struct stream *s;
+  struct event *ev;
+  unsigned int i;
+
+  while ((s = next_stream()) != NULL) {
+    ev = &s->events[s->pos++];
+    printf("%" PRIu64 " %u %u %u", ev->ts, ev->cpu, ev->pid, ev->tag);
+    for (i = 0; i < ev->nr_args; i++)
+      printf(" %#llx", (unsigned long long)ev->args[i]);
+    putchar('\n');
+  }
+}
+
+struct tag_summary {
+  uint32_t tag;
+  uint64_t events;
+  uint64_t first_ts;
+  uint64_t last_ts;
+};
+
+static int cmp_tag(const void *a, const void *b)
+{
+  uint32_t ta = ((const struct tag_summary *)a)->tag;
+  uint32_t tb = ((const struct tag_summary *)b)->tag;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+static void print_summary(uint64_t nr_events)
+{
+  struct tag_summary *sums = NULL, *t, key;
+  size_t nr_sums = 0, i, j;
+  struct event *ev;
+
+  for (i = 0; i < nr_streams; i++) {
+    for (j = 0; j < streams[i].nr_events; j++) {
+      ev = &streams[i].events[j];
+      key.tag = ev->tag;
+      t = bsearch(&key, sums, nr_sums, sizeof(*sums), cmp_tag);
+      if (t == NULL) {
+        sums = xrealloc(sums, (nr_sums + 1) * sizeof(*sums));
+        t = &sums[nr_sums++];
+        *t = (struct tag_summary){.tag = ev->tag,
+                                  .first_ts = ev->ts,
+                                  .last_ts = ev->ts};
+        qsort(sums, nr_sums, sizeof(*sums), cmp_tag);
+        t = bsearch(&key, sums, nr_sums, sizeof(*sums), cmp_tag);
+      }
+      t->events++;
+      if (ev->ts < t->first_ts)
+        t->first_ts = ev->ts;
+      if (ev->ts > t->last_ts)
+        t->last_ts = ev->ts;
+    }
+  }
+
+  printf("tag events share first_ns last_ns\n");
+  for (i = 0; i < nr_sums; i++) {
+    printf("%u %" PRIu64 " %.1f%% %" PRIu64 " %" PRIu64 "\n", sums[i].tag,
+           sums[i].events, 100.0 * sums[i].events / nr_events,
+           sums[i].first_ts, sums[i].last_ts);
+  }
+  free(sums);
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t nr_events = 0;
+  int summary = 0, opt, i;
+  size_t size;
+  uint8_t *buf;
+
+  while ((opt = getopt(argc, argv, "s")) != -1) {
+    if (opt != 's') {
+      fprintf(stderr, "usage: %s [-s] <file>...\n", argv[0]);
+      return 1;
+    }
+    summary = 1;
+  }
+  if (optind == argc) {
+    fprintf(stderr, "usage: %s [-s] <file>...\n", argv[0]);
+    return 1;
+  }
+
+  // chunks point into the file buffers, which are kept until exit
+  for (i = optind; i < argc; i++) {
+    buf = read_file(argv[i], &size);
+    add_chunks(argv[i], buf, size);
+  }
+  for (i = 0; i < (int)nr_streams; i++) {
+    decode_stream(&streams[i]);
+    nr_events += streams[i].nr_events;
+  }
+
+  if (summary)
+    print_summary(nr_events);
+  else
+    print_merged();
+
+  fprintf(stderr, "events %" PRIu64 " chunks %" PRIu64 " lost_chunks %"
+          PRIu64 " bad_chunks %" PRIu64 "\n", nr_events, totals.chunks,
+          totals.lost_chunks, totals.bad_chunks);
+  if (nr_events > 0)
+    fprintf(stderr, "bytes/event %.2f (unencoded %.2f, %.1fx)\n",
+            (double)totals.bytes / nr_events,
+            (double)totals.raw_bytes / nr_events,
+            (double)totals.raw_bytes / totals.bytes);
+  return 0;
+}